@@ -0,0 +1,657 @@
+#include <chrono>
+#include <future>
+#include <iostream>
+
+#include "AgentConnection.hpp"
+
+
+AgentConnection::AgentConnection(boost::asio::io_service &io_service, std::unique_ptr<boost::asio::ip::tcp::socket> socket, unsigned int capabilities) :
+	m_io_service{ io_service },
+	m_strand{ io_service },
+	m_socket{ std::move(socket) },
+	m_capabilities{ capabilities },
+	m_heartbeat_timer{ io_service }
+{
+	boost::system::error_code ec;
+	m_ip = m_socket->remote_endpoint(ec).address().to_string();
+}
+
+
+namespace
+{
+	const std::pair<AgentConnection::Capability, const char *> CAPABILITY_NAMES[] = {
+		{ AgentConnection::CAP_FRAMED, "framed" },
+		{ AgentConnection::CAP_REQUEST_ID, "reqid" },
+		{ AgentConnection::CAP_STATUS, "status" },
+		{ AgentConnection::CAP_EVENTS, "events" },
+		{ AgentConnection::CAP_HEARTBEAT, "heartbeat" }
+	};
+}
+
+
+unsigned int AgentConnection::parseCapabilities(const std::string &list)
+{
+	unsigned int capabilities = 0;
+
+	size_t start = 0;
+	while (start <= list.size())
+	{
+		size_t end = list.find(",", start);
+		if (end == std::string::npos)
+		{
+			end = list.size();
+		}
+
+		std::string cap = list.substr(start, end - start);
+		for (const auto &el : CAPABILITY_NAMES)
+		{
+			if (cap == el.second)
+			{
+				capabilities |= el.first;
+			}
+		}
+
+		start = end + 1;
+	}
+
+	// Responses to pipelined requests have to be delimited
+	if (!(capabilities & CAP_FRAMED))
+	{
+		capabilities &= ~CAP_REQUEST_ID;
+	}
+
+	// Events and heartbeat answers can come at any time, only agents with request ids are read all the time
+	if (!(capabilities & CAP_REQUEST_ID))
+	{
+		capabilities &= ~(CAP_EVENTS | CAP_HEARTBEAT);
+	}
+
+	return capabilities;
+}
+
+
+std::string AgentConnection::formatCapabilities(unsigned int capabilities)
+{
+	std::string list;
+
+	for (const auto &el : CAPABILITY_NAMES)
+	{
+		if (capabilities & el.first)
+		{
+			if (!list.empty())
+			{
+				list += ",";
+			}
+
+			list += el.second;
+		}
+	}
+
+	return list;
+}
+
+
+void AgentConnection::encodeHeader(uint32_t size, unsigned char header[4])
+{
+	header[0] = static_cast<unsigned char>(size >> 24);
+	header[1] = static_cast<unsigned char>(size >> 16);
+	header[2] = static_cast<unsigned char>(size >> 8);
+	header[3] = static_cast<unsigned char>(size);
+}
+
+
+uint32_t AgentConnection::decodeHeader(const unsigned char header[4])
+{
+	return (uint32_t(header[0]) << 24) | (uint32_t(header[1]) << 16) | (uint32_t(header[2]) << 8) | uint32_t(header[3]);
+}
+
+
+bool AgentConnection::parseMessage(size_t size, json &out)
+{
+	try
+	{
+		out = json::parse(m_recv_buffer.data(), m_recv_buffer.data() + size);
+		return true;
+	}
+	catch (json::exception &e)
+	{
+		std::cerr << "[AgentConnection] Failed to parse message with JSON: " << e.what() << "\n";
+		return false;
+	}
+}
+
+
+bool AgentConnection::parseLegacy(size_t received, json &out, bool &complete)
+{
+	try
+	{
+		out = json::parse(m_recv_buffer.data(), m_recv_buffer.data() + received);
+		complete = true;
+		return true;
+	}
+	catch (json::parse_error &e)
+	{
+		// Error past the end of data means the message isn't complete yet
+		if (e.byte <= received || received >= MAX_MESSAGE_SIZE)
+		{
+			std::cerr << "[AgentConnection] Failed to parse message with JSON: " << e.what() << "\n";
+			return true;
+		}
+
+		return false;
+	}
+}
+
+
+void AgentConnection::asyncRequest(const json &msg, unsigned int timeout_ms, ResponseHandler handler)
+{
+	startRequest(msg, timeout_ms, true, handler);
+}
+
+
+void AgentConnection::asyncSend(const json &msg, unsigned int timeout_ms, ResponseHandler handler)
+{
+	startRequest(msg, timeout_ms, false, handler);
+}
+
+
+AgentConnection::RequestStatus AgentConnection::request(const json &msg, unsigned int timeout_ms, json &out)
+{
+	std::promise<RequestStatus> result;
+	std::future<RequestStatus> future = result.get_future();
+
+	asyncRequest(msg, timeout_ms, [&result, &out](RequestStatus status, json &response)
+	{
+		out = std::move(response);
+		result.set_value(status);
+	});
+
+	return future.get();
+}
+
+
+AgentConnection::RequestStatus AgentConnection::send(const json &msg, unsigned int timeout_ms)
+{
+	std::promise<RequestStatus> result;
+	std::future<RequestStatus> future = result.get_future();
+
+	asyncSend(msg, timeout_ms, [&result](RequestStatus status, json &)
+	{
+		result.set_value(status);
+	});
+
+	return future.get();
+}
+
+
+void AgentConnection::asyncHeartbeat(unsigned int timeout_ms, HeartbeatHandler handler)
+{
+	auto self = shared_from_this();
+
+	boost::asio::post(m_strand, [this, self, timeout_ms, handler]()
+	{
+		if (m_closed || !hasCapability(CAP_HEARTBEAT))
+		{
+			handler(REQUEST_FAILED);
+			return;
+		}
+
+		m_heartbeat_handlers.push_back(handler);
+		if (m_heartbeat_handlers.size() > 1)
+		{
+			return;
+		}
+
+		m_heartbeat_seq = (m_heartbeat_seq + 1) & ~HEARTBEAT_FLAG;
+		m_heartbeat_queued = true;
+
+		uint32_t seq = m_heartbeat_seq;
+		m_heartbeat_timer.expires_from_now(std::chrono::milliseconds(timeout_ms));
+		m_heartbeat_timer.async_wait(boost::asio::bind_executor(m_strand, [this, self, seq](const boost::system::error_code &ec)
+		{
+			// The answer may have come after the timer fired, then it's a later heartbeat in flight
+			if (!ec && seq == m_heartbeat_seq && !m_heartbeat_handlers.empty())
+			{
+				finishHeartbeat(REQUEST_TIMED_OUT);
+			}
+		}));
+
+		writeNext();
+	});
+}
+
+
+void AgentConnection::finishHeartbeat(RequestStatus status)
+{
+	// Not written yet, no point in sending it any more. A late answer finds no handlers and is dropped.
+	m_heartbeat_queued = false;
+	m_heartbeat_timer.cancel();
+
+	// Handlers only post to the strand, they can't add to the list while it's walked
+	for (auto &handler : m_heartbeat_handlers)
+	{
+		handler(status);
+	}
+
+	m_heartbeat_handlers.clear();
+}
+
+
+void AgentConnection::startRequest(json msg, unsigned int timeout_ms, bool expect_response, ResponseHandler handler)
+{
+	auto self = shared_from_this();
+
+	auto req = std::make_shared<PendingRequest>();
+	req->expect_response = expect_response;
+	req->handler = handler;
+	req->timer = std::make_unique<boost::asio::steady_timer>(m_io_service);
+
+	boost::asio::post(m_strand, [this, self, req, msg, timeout_ms]() mutable
+	{
+		if (m_closed)
+		{
+			json empty;
+			complete(req, REQUEST_FAILED, empty);
+			return;
+		}
+
+		if (req->expect_response && hasCapability(CAP_REQUEST_ID))
+		{
+			req->id = m_next_id++;
+			msg["id"] = req->id;
+		}
+
+		std::string payload = msg.dump();
+		if (hasCapability(CAP_FRAMED))
+		{
+			unsigned char header[4];
+			encodeHeader(static_cast<uint32_t>(payload.size()), header);
+			req->data.assign(reinterpret_cast<char *>(header), sizeof(header));
+		}
+
+		req->data += payload;
+
+		req->timer->expires_from_now(std::chrono::milliseconds(timeout_ms));
+		req->timer->async_wait(boost::asio::bind_executor(m_strand, [this, self, req](const boost::system::error_code &ec)
+		{
+			if (!ec)
+			{
+				handleTimeout(req);
+			}
+		}));
+
+		m_queue.push_back(req);
+		writeNext();
+	});
+}
+
+
+void AgentConnection::complete(const std::shared_ptr<PendingRequest> &req, RequestStatus status, json &response)
+{
+	if (req->finished)
+	{
+		return;
+	}
+
+	req->finished = true;
+	req->timer->cancel();
+	req->handler(status, response);
+}
+
+
+void AgentConnection::handleTimeout(const std::shared_ptr<PendingRequest> &req)
+{
+	if (req->finished)
+	{
+		return;
+	}
+
+	if (hasCapability(CAP_REQUEST_ID))
+	{
+		// A late answer won't find the request and gets dropped
+		m_in_flight.erase(req->id);
+	}
+	else if (req == m_current)
+	{
+		// Requests still in the queue are skipped when their turn comes, but the answer
+		// to a request that was already written would be taken for the next response
+		m_current.reset();
+		closeConnection();
+	}
+
+	json empty;
+	complete(req, REQUEST_TIMED_OUT, empty);
+}
+
+
+void AgentConnection::writeNext()
+{
+	if (m_current || m_writing_heartbeat || m_closed)
+	{
+		return;
+	}
+
+	auto self = shared_from_this();
+
+	if (m_heartbeat_queued)
+	{
+		m_heartbeat_queued = false;
+		m_writing_heartbeat = true;
+
+		// Encoded only now, the previous heartbeat may have been written from the buffer until now
+		encodeHeader(HEARTBEAT_FLAG | m_heartbeat_seq, m_heartbeat_frame);
+
+		boost::asio::async_write(*m_socket, boost::asio::buffer(m_heartbeat_frame), boost::asio::bind_executor(m_strand, [this, self](const boost::system::error_code &ec, size_t)
+		{
+			m_writing_heartbeat = false;
+			if (ec)
+			{
+				closeConnection(true);
+				return;
+			}
+
+			writeNext();
+			startReading();
+		}));
+
+		return;
+	}
+
+	while (!m_queue.empty())
+	{
+		std::shared_ptr<PendingRequest> req = m_queue.front();
+		m_queue.pop_front();
+
+		// Timed out while waiting in the queue
+		if (req->finished)
+		{
+			continue;
+		}
+
+		m_current = req;
+
+		// Registered before writing, with a read already running the answer can be handled
+		// before the write completion
+		if (req->expect_response && hasCapability(CAP_REQUEST_ID))
+		{
+			m_in_flight[req->id] = req;
+		}
+
+		boost::asio::async_write(*m_socket, boost::asio::buffer(req->data), boost::asio::bind_executor(m_strand, [this, self, req](const boost::system::error_code &ec, size_t)
+		{
+			handleWritten(req, ec);
+		}));
+
+		return;
+	}
+}
+
+
+void AgentConnection::handleWritten(const std::shared_ptr<PendingRequest> &req, const boost::system::error_code &ec)
+{
+	if (ec)
+	{
+		closeConnection(true);
+		return;
+	}
+
+	if (!req->expect_response)
+	{
+		m_current.reset();
+		writeNext();
+
+		json empty;
+		complete(req, REQUEST_OK, empty);
+		return;
+	}
+
+	if (hasCapability(CAP_REQUEST_ID))
+	{
+		// Pipelining: write the next one without waiting for the response
+		m_current.reset();
+		writeNext();
+	}
+
+	// Legacy agents answer one request at a time, m_current stays set until the response arrives
+	startReading();
+}
+
+
+void AgentConnection::startReading()
+{
+	if (m_reading || m_closed)
+	{
+		return;
+	}
+
+	m_reading = true;
+
+	auto self = shared_from_this();
+	MessageHandler handler = [this, self](bool ok, json &msg)
+	{
+		handleMessage(ok, msg);
+	};
+
+	if (hasCapability(CAP_FRAMED))
+	{
+		asyncRecvFramed(handler);
+	}
+	else
+	{
+		asyncRecvLegacy(0, handler);
+	}
+}
+
+
+void AgentConnection::handleMessage(bool ok, json &msg)
+{
+	m_reading = false;
+
+	if (!ok)
+	{
+		closeConnection(true);
+		return;
+	}
+
+	std::shared_ptr<PendingRequest> req;
+
+	if (hasCapability(CAP_REQUEST_ID))
+	{
+		auto find = msg.count("id") && msg["id"].is_number_unsigned() ? m_in_flight.find(msg["id"].get<uint32_t>()) : m_in_flight.end();
+		if (find != m_in_flight.end())
+		{
+			req = find->second;
+			m_in_flight.erase(find);
+		}
+		else if (msg.count("event") && !msg.count("id") && hasCapability(CAP_EVENTS))
+		{
+			if (m_event_handler)
+			{
+				m_event_handler(msg);
+			}
+		}
+		else
+		{
+			std::cerr << "[AgentConnection] Dropping message that doesn't answer any pending request from " << m_ip << "\n";
+		}
+
+		// Agents with request ids are read continuously
+		startReading();
+	}
+	else
+	{
+		req = m_current;
+		m_current.reset();
+		writeNext();
+	}
+
+	if (req)
+	{
+		complete(req, REQUEST_OK, msg);
+	}
+}
+
+
+void AgentConnection::asyncRecvFramed(MessageHandler handler)
+{
+	auto self = shared_from_this();
+
+	boost::asio::async_read(*m_socket, boost::asio::buffer(m_recv_header), boost::asio::bind_executor(m_strand, [this, self, handler](const boost::system::error_code &ec, size_t)
+	{
+		json msg;
+
+		uint32_t size = decodeHeader(m_recv_header);
+		if (!ec && !m_closed && (size & HEARTBEAT_FLAG) && hasCapability(CAP_HEARTBEAT))
+		{
+			// Heartbeat answer, nothing follows the header
+			if ((size & ~HEARTBEAT_FLAG) == m_heartbeat_seq && !m_heartbeat_handlers.empty())
+			{
+				finishHeartbeat(REQUEST_OK);
+			}
+
+			asyncRecvFramed(handler);
+			return;
+		}
+
+		if (ec || size > MAX_MESSAGE_SIZE || m_closed)
+		{
+			handler(false, msg);
+			return;
+		}
+
+		if (m_recv_buffer.size() < size)
+		{
+			m_recv_buffer.resize(size);
+		}
+
+		boost::asio::async_read(*m_socket, boost::asio::buffer(m_recv_buffer.data(), size), boost::asio::bind_executor(m_strand, [this, self, handler, size](const boost::system::error_code &ec, size_t)
+		{
+			json msg;
+			bool ok = !ec && parseMessage(size, msg);
+			handler(ok, msg);
+		}));
+	}));
+}
+
+
+void AgentConnection::asyncRecvLegacy(size_t received, MessageHandler handler)
+{
+	auto self = shared_from_this();
+
+	if (m_recv_buffer.size() < received + READ_CHUNK_SIZE)
+	{
+		m_recv_buffer.resize(received + READ_CHUNK_SIZE);
+	}
+
+	auto buffer = boost::asio::buffer(m_recv_buffer.data() + received, m_recv_buffer.size() - received);
+	m_socket->async_read_some(buffer, boost::asio::bind_executor(m_strand, [this, self, handler, received](const boost::system::error_code &ec, size_t n_received)
+	{
+		json msg;
+
+		if (ec || !n_received || m_closed)
+		{
+			handler(false, msg);
+			return;
+		}
+
+		bool complete = false;
+		if (parseLegacy(received + n_received, msg, complete))
+		{
+			handler(complete, msg);
+			return;
+		}
+
+		asyncRecvLegacy(received + n_received, handler);
+	}));
+}
+
+
+void AgentConnection::close()
+{
+	// Visible to isOpen() right away, the rest happens in the strand
+	m_closed = true;
+
+	auto self = shared_from_this();
+	boost::asio::post(m_strand, [this, self]()
+	{
+		closeConnection();
+	});
+}
+
+
+void AgentConnection::closeConnection(bool lost)
+{
+	if (!m_closed)
+	{
+		m_lost = lost;
+	}
+
+	m_closed = true;
+
+	boost::system::error_code ignored;
+	m_socket->close(ignored);
+
+	std::vector<std::shared_ptr<PendingRequest>> pending(m_queue.begin(), m_queue.end());
+	m_queue.clear();
+
+	for (auto &el : m_in_flight)
+	{
+		pending.push_back(el.second);
+	}
+	m_in_flight.clear();
+
+	if (m_current)
+	{
+		pending.push_back(m_current);
+		m_current.reset();
+	}
+
+	json empty;
+	for (auto &req : pending)
+	{
+		complete(req, REQUEST_FAILED, empty);
+	}
+
+	if (!m_heartbeat_handlers.empty())
+	{
+		finishHeartbeat(REQUEST_FAILED);
+	}
+
+	// Only the first close is reported
+	if (m_close_handler && m_lost)
+	{
+		CloseHandler handler = std::move(m_close_handler);
+		m_close_handler = nullptr;
+		handler();
+	}
+}
+
+
+void AgentConnection::setEventHandler(EventHandler handler)
+{
+	auto self = shared_from_this();
+	boost::asio::post(m_strand, [this, self, handler]()
+	{
+		m_event_handler = handler;
+	});
+}
+
+
+void AgentConnection::setCloseHandler(CloseHandler handler)
+{
+	auto self = shared_from_this();
+	boost::asio::post(m_strand, [this, self, handler]()
+	{
+		if (m_closed)
+		{
+			if (m_lost)
+			{
+				handler();
+			}
+
+			return;
+		}
+
+		m_close_handler = handler;
+	});
+}
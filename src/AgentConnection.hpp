@@ -0,0 +1,196 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+
+using json = nlohmann::json;
+
+
+// TCP connection to a single agent
+//
+// Agents announce what they support in the identification message:
+//   agentName/<name>[/<capability>,<capability>...]
+// The manager answers with the capabilities it accepted, ended by a newline since framed
+// messages may follow it in the same read:
+//   agentAccept/<capability>,<capability>...\n
+// Agents that don't send any capabilities get no answer and talk the legacy protocol.
+//
+// Agents with CAP_EVENTS that were sent {"cmd": "subscribe", "action": "proc"} push
+//   {"event": "proc", "data": {<process>: <running>, ...}}
+// with the complete list of their monitored processes whenever one of them changes.
+//
+// Agents with CAP_HEARTBEAT are checked for liveness with a bare frame header that has the top
+// bit set and a sequence number in the other 31 bits, without any payload. The agent writes the
+// same 4 bytes back, between two of its messages. No JSON is built or parsed for it.
+//
+// All I/O of a connection and all of its state changes run in its strand, so requests to one
+// agent stay ordered while different agents are served in parallel by the io threads.
+class AgentConnection : public std::enable_shared_from_this<AgentConnection>
+{
+public:
+	enum RequestStatus
+	{
+		REQUEST_OK,
+		REQUEST_FAILED,
+		REQUEST_TIMED_OUT
+	};
+
+	// Called exactly once from the connection's strand when the response arrives, the request
+	// fails or its deadline passes
+	using ResponseHandler = std::function<void(RequestStatus status, json &response)>;
+	using EventHandler = std::function<void(json &event)>;
+	using CloseHandler = std::function<void()>;
+	using HeartbeatHandler = std::function<void(RequestStatus status)>;
+
+	enum Capability : unsigned int
+	{
+		// Every message is prefixed with its length (4 bytes, big endian)
+		CAP_FRAMED = 1 << 0,
+		// Agent echoes the "id" of a request in its response, so requests can be pipelined.
+		// Only accepted together with CAP_FRAMED.
+		CAP_REQUEST_ID = 1 << 1,
+		// Agent answers the "status" command: liveness, monitored processes and filter in one response
+		CAP_STATUS = 1 << 2,
+		// Agent pushes events after the "subscribe" command. Only accepted together with CAP_REQUEST_ID,
+		// events are told apart from responses by having no "id".
+		CAP_EVENTS = 1 << 3,
+		// Agent echoes heartbeat frames. Only accepted together with CAP_REQUEST_ID, the answer
+		// can come between any two responses.
+		CAP_HEARTBEAT = 1 << 4
+	};
+
+	// Upper bound for a single message, anything larger is treated as a broken stream
+	static const uint32_t MAX_MESSAGE_SIZE{ 16 * 1024 * 1024 };
+	static const size_t READ_CHUNK_SIZE{ 4096 };
+	// Marks a frame header as a heartbeat, real messages never get this large
+	static const uint32_t HEARTBEAT_FLAG{ 0x80000000 };
+
+private:
+	// Request waiting to be written or for its response
+	struct PendingRequest
+	{
+		uint32_t id{ 0 };
+		bool expect_response{ true };
+		// Encoded message, including the frame header
+		std::string data;
+		ResponseHandler handler;
+		std::unique_ptr<boost::asio::steady_timer> timer;
+		// Handler was called already
+		bool finished{ false };
+	};
+
+	using MessageHandler = std::function<void(bool ok, json &msg)>;
+
+	boost::asio::io_service &m_io_service;
+	boost::asio::io_service::strand m_strand;
+	std::unique_ptr<boost::asio::ip::tcp::socket> m_socket;
+	unsigned int m_capabilities;
+	std::string m_ip;
+
+	std::atomic<bool> m_closed{ false };
+	// Connection was closed because the agent went away, not by the monitor
+	bool m_lost{ false };
+
+	// Everything below is only touched from m_strand
+
+	// Requests not written yet, written one at a time
+	std::deque<std::shared_ptr<PendingRequest>> m_queue;
+	// Request being written, for legacy agents also until its response arrives
+	std::shared_ptr<PendingRequest> m_current;
+	// Written requests waiting for a response, by id (CAP_REQUEST_ID only)
+	std::map<uint32_t, std::shared_ptr<PendingRequest>> m_in_flight;
+	uint32_t m_next_id{ 1 };
+	bool m_reading{ false };
+
+	EventHandler m_event_handler;
+	CloseHandler m_close_handler;
+
+	// Heartbeat in flight, everyone who asks for one meanwhile gets its result
+	std::vector<HeartbeatHandler> m_heartbeat_handlers;
+	boost::asio::steady_timer m_heartbeat_timer;
+	uint32_t m_heartbeat_seq{ 0 };
+	// Filled in by writeNext() right before it is written, never while a heartbeat is being written
+	unsigned char m_heartbeat_frame[4];
+	// Waits for the request being written, heartbeats are written before the queued requests
+	bool m_heartbeat_queued{ false };
+	bool m_writing_heartbeat{ false };
+
+	// Reused for every received message, grows to fit the largest one
+	std::vector<char> m_recv_buffer;
+	unsigned char m_recv_header[4];
+
+	static void encodeHeader(uint32_t size, unsigned char header[4]);
+	static uint32_t decodeHeader(const unsigned char header[4]);
+	bool parseMessage(size_t size, json &out);
+
+	// Returns true when done with the legacy message, complete = false means it couldn't be parsed
+	bool parseLegacy(size_t received, json &out, bool &complete);
+
+	void startRequest(json msg, unsigned int timeout_ms, bool expect_response, ResponseHandler handler);
+
+	// These run in m_strand
+	void complete(const std::shared_ptr<PendingRequest> &req, RequestStatus status, json &response);
+	void handleTimeout(const std::shared_ptr<PendingRequest> &req);
+	void finishHeartbeat(RequestStatus status);
+	// lost is true when the agent closed the connection or it broke
+	void closeConnection(bool lost = false);
+	void writeNext();
+	void startReading();
+	void asyncRecvFramed(MessageHandler handler);
+	void asyncRecvLegacy(size_t received, MessageHandler handler);
+
+	void handleWritten(const std::shared_ptr<PendingRequest> &req, const boost::system::error_code &ec);
+	void handleMessage(bool ok, json &msg);
+
+public:
+	AgentConnection(boost::asio::io_service &io_service, std::unique_ptr<boost::asio::ip::tcp::socket> socket, unsigned int capabilities);
+
+	// Parses the comma separated capability list from the identification message,
+	// unknown capabilities are ignored
+	static unsigned int parseCapabilities(const std::string &list);
+	static std::string formatCapabilities(unsigned int capabilities);
+
+	bool hasCapability(Capability cap) const { return (m_capabilities & cap) != 0; }
+	unsigned int getCapabilities() const { return m_capabilities; }
+
+	// Sends the request and reads its response without blocking the caller. If the response
+	// doesn't arrive within timeout_ms, handler gets REQUEST_TIMED_OUT.
+	//
+	// Agents with CAP_REQUEST_ID get every request right away and may answer them in any order,
+	// a late answer to a timed out request is dropped.
+	// Legacy agents get one request at a time, the others wait in a queue. When a request
+	// to a legacy agent times out, the connection is closed, so its late answer is never
+	// taken for a response to the next request.
+	void asyncRequest(const json &msg, unsigned int timeout_ms, ResponseHandler handler);
+	// Same as asyncRequest, but for messages the agent doesn't answer
+	void asyncSend(const json &msg, unsigned int timeout_ms, ResponseHandler handler);
+
+	// Blocking versions of the above, must not be called from an io thread
+	RequestStatus request(const json &msg, unsigned int timeout_ms, json &out);
+	RequestStatus send(const json &msg, unsigned int timeout_ms);
+
+	// Checks the agent is alive with a heartbeat frame (CAP_HEARTBEAT only, fails otherwise).
+	// A heartbeat that is already in flight is shared, along with its deadline.
+	void asyncHeartbeat(unsigned int timeout_ms, HeartbeatHandler handler);
+
+	// Fails all pending requests with REQUEST_FAILED and closes the connection
+	void close();
+
+	// Called from the connection's strand for every event the agent pushes
+	void setEventHandler(EventHandler handler);
+	// Called once from the connection's strand when the agent closes the connection or it breaks,
+	// not when the monitor closes it
+	void setCloseHandler(CloseHandler handler);
+
+	bool isOpen() const { return !m_closed; }
+	const std::string &getIp() const { return m_ip; }
+};
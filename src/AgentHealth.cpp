@@ -0,0 +1,99 @@
+#include <algorithm>
+#include <iostream>
+
+#include "AgentHealth.hpp"
+
+
+const unsigned int AgentHealth::FAILURE_THRESHOLD;
+const unsigned int AgentHealth::INITIAL_BACKOFF;
+const unsigned int AgentHealth::MAX_BACKOFF;
+
+
+AgentHealth::Action AgentHealth::check(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end() || find->second.failures < FAILURE_THRESHOLD)
+	{
+		return ALLOW;
+	}
+
+	Agent &entry = find->second;
+	if (entry.probing || std::chrono::steady_clock::now() < entry.retry_at)
+	{
+		return REJECT;
+	}
+
+	entry.probing = true;
+	return PROBE;
+}
+
+
+void AgentHealth::succeeded(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end())
+	{
+		return;
+	}
+
+	if (find->second.failures >= FAILURE_THRESHOLD)
+	{
+		std::cout << "[AgentHealth] Agent \"" << agent << "\" is answering again\n";
+	}
+
+	m_agents.erase(find);
+}
+
+
+AgentHealth::State AgentHealth::failed(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	Agent &entry = m_agents[agent];
+	entry.failures++;
+	entry.probing = false;
+
+	if (entry.failures < FAILURE_THRESHOLD)
+	{
+		return DEGRADED;
+	}
+
+	// Doubles with every failed probe
+	unsigned int backoff = INITIAL_BACKOFF;
+	for (unsigned int i = 0; i < entry.opened && backoff < MAX_BACKOFF; i++)
+	{
+		backoff *= 2;
+	}
+
+	backoff = std::min(backoff, MAX_BACKOFF);
+	entry.opened++;
+	entry.retry_at = std::chrono::steady_clock::now() + std::chrono::seconds(backoff);
+
+	std::cerr << "[AgentHealth] Agent \"" << agent << "\" failed " << entry.failures << " request(s) in a row, not sending anything to it for " << backoff << " s\n";
+	return OPEN;
+}
+
+
+void AgentHealth::reset(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_agents.erase(agent);
+}
+
+
+AgentHealth::State AgentHealth::getState(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end())
+	{
+		return HEALTHY;
+	}
+
+	return find->second.failures < FAILURE_THRESHOLD ? DEGRADED : OPEN;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+
+// Circuit breaker of every agent
+//
+// An agent that fails a request (doesn't answer in time or answers garbage) is degraded. After
+// FAILURE_THRESHOLD failures in a row its circuit opens and nothing is sent to it for a backoff,
+// which doubles every time the circuit opens again, from INITIAL_BACKOFF up to MAX_BACKOFF. Once
+// the backoff is over a single probe is let through: if it succeeds the agent is healthy again,
+// if it fails the circuit opens for longer. A few sick agents then cost a probe per backoff
+// instead of a timed out request per poll.
+class AgentHealth
+{
+public:
+	enum State
+	{
+		HEALTHY,
+		DEGRADED,
+		OPEN
+	};
+
+	enum Action
+	{
+		// Send requests as usual
+		ALLOW,
+		// Backoff is over, one request tells if the agent recovered
+		PROBE,
+		// Circuit is open, don't send anything
+		REJECT
+	};
+
+	static const unsigned int FAILURE_THRESHOLD{ 3 };
+	// Seconds
+	static const unsigned int INITIAL_BACKOFF{ 10 };
+	static const unsigned int MAX_BACKOFF{ 600 };
+
+private:
+	struct Agent
+	{
+		// Failed requests in a row
+		unsigned int failures{ 0 };
+		// Times the circuit opened since the agent was healthy
+		unsigned int opened{ 0 };
+		std::chrono::steady_clock::time_point retry_at;
+		// A probe was let through and hasn't finished yet
+		bool probing{ false };
+	};
+
+	std::mutex m_mutex;
+	// Only agents that aren't healthy
+	std::map<std::string, Agent> m_agents;
+
+public:
+	// Asks before sending a request, the result of an allowed request must be reported
+	// with succeeded or failed
+	Action check(const std::string &agent);
+	void succeeded(const std::string &agent);
+	// Returns the state after the failure
+	State failed(const std::string &agent);
+
+	// Agent reconnected or went away, a new connection starts healthy
+	void reset(const std::string &agent);
+
+	State getState(const std::string &agent);
+};
@@ -1,15 +1,25 @@
 #include <boost/chrono.hpp>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <future>
 
 #include "AgentManager.hpp"
+#include "MemoryStorage.hpp"
+#include "MySqlStorage.hpp"
 #include "json.hpp"
 
 using json = nlohmann::json;
 
 
+const unsigned int AgentManager::IDENTIFICATION_TIMEOUT;
+const unsigned int AgentManager::ACCEPT_RETRY_DELAY;
+
+
 AgentManager::AgentManager(uint16_t discover_port, uint16_t server_port) :
 	m_discover_port{ discover_port },
 	m_server_port{ server_port },
-	m_db{ MySqlJdbcConnector() }
+	m_accept_timer{ m_io_service }
 {
 	;
 }
@@ -23,13 +33,21 @@ bool AgentManager::loadConfiguration(const std::string &xml_config)
 
 bool AgentManager::connectToDb()
 {
-	if (!m_db.connect(m_config))
+	if (m_config.getStorage() == "memory")
+	{
+		m_storage = std::make_unique<MemoryStorage>();
+	}
+	else
 	{
-		std::cerr << "[AgentManager] Couldn't connect to Mysql database\n";
+		m_storage = std::make_unique<MySqlStorage>();
+	}
+
+	if (!m_storage->connect(m_config))
+	{
+		std::cerr << "[AgentManager] Couldn't connect to storage\n";
 		return false;
 	}
 
-	std::cout << "[AgentManager] Connected to Mysql database\n";
 	return true;
 }
 
@@ -62,380 +80,870 @@ void AgentManager::discoverAgents()
 void AgentManager::run()
 {
 	m_acceptor = std::make_unique<boost::asio::ip::tcp::acceptor>(m_io_service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), m_server_port));
+	m_io_work = std::make_unique<boost::asio::io_service::work>(m_io_service);
+
+	m_db_writer.start(*m_storage, m_config.getDbQueueSize(), m_config.getSpoolDir(), m_config.getSpoolSize());
+	m_scheduler.setLimits(std::chrono::seconds(m_config.getMinUpdateInterval()), std::chrono::seconds(m_config.getMaxUpdateInterval()));
 
-	m_main_thread = boost::thread([this]()
+	std::cout << "[AgentManager] Listening on port " << m_server_port << "\n";
+	startAccept();
+
+	unsigned int n_threads = m_config.getIoThreads();
+	if (!n_threads)
 	{
-		std::cout << "[AgentManager] Listening on port " << m_server_port << "\n";
+		n_threads = std::max(1u, boost::thread::hardware_concurrency());
+	}
 
-		while (true)
-		{
-			std::unique_ptr<boost::asio::ip::tcp::socket> conn = std::make_unique<boost::asio::ip::tcp::socket>(m_io_service);
-			m_acceptor->accept(*conn);
+	std::cout << "[AgentManager] Starting " << n_threads << " io thread(s)\n";
 
-			// Receive identification message from the agent
-			try
+	for (unsigned int i = 0; i < n_threads; i++)
+	{
+		m_io_threads.create_thread([this]()
+		{
+			while (true)
 			{
-				boost::system::error_code ec;
-				char buffer[MAX_BUFFER_SIZE] = { 0 };
-				size_t n_received = conn->read_some(boost::asio::buffer(buffer), ec);
+				try
+				{
+					m_io_service.run();
+					break;
+				}
+				catch (std::exception &e)
+				{
+					// A handler threw, keep the thread in the pool
+					std::cerr << "[AgentManager] Exception in io thread: " << e.what() << "\n";
+				}
+			}
+		});
+	}
 
-				if (!n_received)
+	boost::thread checking_thread = boost::thread([this]()
+	{
+		while (true)
+		{
+			// Update statuses and monitored processes of the agents that are due, they are
+			// due again one interval later, after their poll finished
+			Connections connections, liveness, probes;
+			for (const std::string &agent : m_scheduler.waitDue())
+			{
+				std::shared_ptr<AgentConnection> conn = m_registry.find(agent);
+				if (!conn)
 				{
-					// No data received from the agent
-					conn->close();
+					// Disconnected since the last poll
+					m_scheduler.remove(agent);
 					continue;
 				}
 
-				// Agent identification
-				std::string ident(buffer, n_received);
-
-				if (ident.find("agentName", 0) == std::string::npos)
+				switch (m_health.check(agent))
 				{
-					// Invalid identification format
-					conn->close();
-					continue;
+				case AgentHealth::ALLOW:
+					if (reconcileDue(agent))
+					{
+						connections.push_back(std::make_pair(agent, conn));
+					}
+					else
+					{
+						// Pushes its process changes, only checked to be alive
+						liveness.push_back(std::make_pair(agent, conn));
+					}
+					break;
+
+				case AgentHealth::PROBE:
+					// Only a ping, until it's clear the agent is back
+					probes.push_back(std::make_pair(agent, conn));
+					break;
+
+				case AgentHealth::REJECT:
+					m_scheduler.skipped(agent);
+					break;
 				}
+			}
 
-				size_t delim = ident.find("/", 0);
-				if (delim)
+			auto finished = [this](const PollStates &states)
+			{
+				for (const auto &el : states)
 				{
-					std::string agent = ident.substr(delim + 1, ident.size() - delim);
-					std::cout << "[AgentManager] Establishing tcp connection with agent \"" << agent << "\"\n";
+					m_scheduler.finished(el.first, el.second);
+				}
+			};
 
-					m_control_mutex.lock();
-					addConnection(agent, std::move(conn));
-					m_control_mutex.unlock();
+			pollAgents(connections, true, finished);
 
-					addAgentToDb(agent);
-				}
-			}
-			catch (sql::SQLException &e)
+			if (!liveness.empty())
 			{
-				std::cerr << "[AgentManager] Failed to add agent to DB: " << e.what() << "\n";
+				pollAgents(liveness, false, finished);
 			}
-			catch (boost::system::system_error &e)
+
+			if (!probes.empty())
 			{
-				std::cerr << "[AgentManager] Failed to receive message: " << e.what() << "\n";
+				pollAgents(probes, false, finished);
 			}
 		}
 	});
 
-	boost::thread checking_thread = boost::thread([this]()
+	checking_thread.detach();
+
+	boost::thread rollup_thread = boost::thread([this]()
 	{
 		while (true)
 		{
-			m_db.tryReconnect();
-
-			// Not using mutex here because refresh does that
-			// Update agent statuses
-			refreshAgentStatuses();
-			
-			// Lock mutex so nothing is added to the dict meanwhile & cmdline doesnt issue a command
-			m_control_mutex.lock();
-			for (const auto &el : m_connections)
-			{
-				// Dont care about return value
-				updateAgentProcesses(el.first);
-			}
-			m_control_mutex.unlock();
+			boost::this_thread::sleep_for(boost::chrono::seconds(ROLLUP_INTERVAL));
 
-			boost::this_thread::sleep_for(boost::chrono::seconds(m_config.getAgentUpdateInterval()));
+			// Uptime of the hours and days that ended
+			m_storage->rollup(std::time(nullptr));
 		}
 	});
 
-	checking_thread.detach();
+	rollup_thread.detach();
 }
 
 
 void AgentManager::join()
 {
-	m_main_thread.join();
+	m_io_threads.join_all();
 }
 
 
-void AgentManager::refreshAgentStatuses()
+void AgentManager::startAccept()
 {
-	m_control_mutex.lock();
+	auto pending = std::make_shared<PendingAgent>(m_io_service);
+	pending->conn = std::make_unique<boost::asio::ip::tcp::socket>(m_io_service);
 
-	// https://stackoverflow.com/questions/8234779/how-to-remove-from-a-map-while-iterating-it
-	for (auto it = m_connections.cbegin(); it != m_connections.cend(); )
+	m_acceptor->async_accept(*pending->conn, [this, pending](const boost::system::error_code &ec)
 	{
-		// Copy by value because we delete the pair from the map in one if
-		std::string agent = (*it).first;
+		handleAccept(pending, ec);
+	});
+}
 
-		try
+
+void AgentManager::handleAccept(std::shared_ptr<PendingAgent> pending, const boost::system::error_code &ec)
+{
+	if (ec)
+	{
+		std::cerr << "[AgentManager] Failed to accept connection: " << ec.message() << "\n";
+
+		// Errors like running out of file descriptors fail again right away, give them a moment
+		m_accept_timer.expires_from_now(std::chrono::milliseconds(ACCEPT_RETRY_DELAY));
+		m_accept_timer.async_wait([this](const boost::system::error_code &ec)
 		{
-			bool running = true;
-			if (!ping(agent))
+			if (!ec)
 			{
-				running = false;
-				m_connections.erase(it++);
+				startAccept();
 			}
-			else
-			{
+		});
+		return;
+	}
 
-				++it;
-			}
+	// Accept the next agent right away, so a slow agent can't stall the others
+	startAccept();
 
-			if (!updateAgentStatus(agent, running))
-			{
-				std::cerr << "[AgentManager] Failed to update agent \"" << agent << "\" status\n";
-			}
-		}
-		catch (sql::SQLException &e)
+	// A peer that connects and never says anything doesn't get to keep the socket
+	pending->timer.expires_from_now(std::chrono::seconds(IDENTIFICATION_TIMEOUT));
+	pending->timer.async_wait(boost::asio::bind_executor(pending->strand, [pending](const boost::system::error_code &ec)
+	{
+		if (!ec && pending->conn)
 		{
-			std::cerr << "[AgentManager] SQL error while updating status: " << e.what() << "\n";
+			std::cerr << "[AgentManager] Connection didn't identify itself in time, closing it\n";
+
+			boost::system::error_code ignored;
+			pending->conn->close(ignored);
 		}
-	}
+	}));
 
-	m_control_mutex.unlock();
+	// Receive identification message from the agent
+	pending->conn->async_read_some(boost::asio::buffer(pending->buffer), boost::asio::bind_executor(pending->strand, [this, pending](const boost::system::error_code &ec, size_t n_received)
+	{
+		handleIdentification(pending, ec, n_received);
+	}));
 }
 
 
-bool AgentManager::updateAgentProcesses(const std::string &agent, bool print)
+void AgentManager::handleIdentification(std::shared_ptr<PendingAgent> pending, const boost::system::error_code &ec, size_t n_received)
 {
-	json request;
-	request["cmd"] = "proc";
-	request["action"] = "get";
-	request["data"] = "";
+	boost::system::error_code ignored;
 
-	if (!sendMessage(agent, request.dump()))
+	if (ec || !n_received)
 	{
-		std::cerr << "[AgentManager] Failed to send request to get monitored processes from agent\n";
-		return false;
+		// No data received from the agent
+		pending->timer.cancel();
+		pending->conn->close(ignored);
+		return;
 	}
 
-	json response;
-	if (!recvMessage(agent, response))
+	// Agent identification
+	std::string ident(pending->buffer, n_received);
+
+	if (ident.find("agentName", 0) == std::string::npos)
 	{
-		std::cerr << "[AgentManager] Failed to get monitored processes from agent\n";
-		return false;
+		// Invalid identification format
+		pending->timer.cancel();
+		pending->conn->close(ignored);
+		return;
 	}
 
-	if (print)
+	size_t delim = ident.find("/", 0);
+	if (delim)
 	{
-		for (const auto &el : response["response"].items())
+		std::string agent = ident.substr(delim + 1, ident.size() - delim);
+
+		// Optional capability list after the name: agentName/<name>/<capabilities>
+		size_t caps_delim = agent.find("/", 0);
+		if (caps_delim == std::string::npos)
 		{
-			std::cout << "Process: \"" << el.key() << "\": " << (el.value() ? "running" : "not running") << "\n";
+			establishConnection(pending, agent, 0);
+			return;
 		}
+
+		unsigned int capabilities = AgentConnection::parseCapabilities(agent.substr(caps_delim + 1));
+		agent = agent.substr(0, caps_delim);
+
+		// Tell the agent which of its capabilities we accepted, agents that don't announce
+		// any don't expect an answer. The identification deadline covers the answer too.
+		// The newline ends the answer, the agent may get the first framed message in the same read.
+		pending->accept = "agentAccept/" + AgentConnection::formatCapabilities(capabilities) + "\n";
+		boost::asio::async_write(*pending->conn, boost::asio::buffer(pending->accept), boost::asio::bind_executor(pending->strand, [this, pending, agent, capabilities](const boost::system::error_code &ec, size_t)
+		{
+			if (ec)
+			{
+				boost::system::error_code ignored;
+				pending->timer.cancel();
+				pending->conn->close(ignored);
+				return;
+			}
+
+			establishConnection(pending, agent, capabilities);
+		}));
 	}
+}
+
+
+void AgentManager::establishConnection(std::shared_ptr<PendingAgent> pending, const std::string &agent, unsigned int capabilities)
+{
+	pending->timer.cancel();
+
+	std::cout << "[AgentManager] Establishing tcp connection with agent \"" << agent << "\"\n";
 
 	try
 	{
-		auto stat = m_db.prepareStatement("SELECT id FROM agents WHERE name = ?");
-		stat->setString(1, agent);
+		std::string ip = pending->conn->remote_endpoint().address().to_string();
+		auto conn = std::make_shared<AgentConnection>(m_io_service, std::move(pending->conn), capabilities);
 
-		std::unique_ptr<sql::ResultSet> res(stat->executeQuery());
-		if (!res->first())
+		addConnection(agent, std::move(conn));
+
+		m_db_writer.agentConnected(agent, ip, AGENT_RUNNING);
+	}
+	catch (boost::system::system_error &e)
+	{
+		std::cerr << "[AgentManager] Failed to add agent: " << e.what() << "\n";
+	}
+}
+
+
+void AgentManager::refreshAgentStatuses()
+{
+	// Agents whose circuit is open are left out, they keep their last status
+	Connections connections;
+	for (const auto &el : m_registry.snapshot())
+	{
+		if (m_health.check(el.first) != AgentHealth::REJECT)
 		{
-			return false;
+			connections.push_back(el);
 		}
-		
-		int agent_id = res->getInt("id");
+	}
+
+	std::promise<void> finished;
+	std::future<void> future = finished.get_future();
+
+	pollAgents(connections, false, [&finished](const PollStates &)
+	{
+		finished.set_value();
+	});
+
+	future.wait();
+}
+
+
+void AgentManager::pollAgents(const Connections &connections, bool processes, std::function<void(const PollStates &states)> done)
+{
+	struct PollResult
+	{
+		int status{ AGENT_NOT_RUNNING };
+		bool has_processes{ false };
+		json processes;
+		// When the processes arrived, the results are stored only once the whole poll finished
+		std::chrono::steady_clock::time_point received_at;
+		std::time_t observed_at{ 0 };
+	};
+
+	// Results of the requests, shared with the handlers
+	struct PollResults
+	{
+		std::mutex mutex;
+		size_t pending{ 0 };
+		std::map<std::string, PollResult> agents;
+	};
+
+	json ping_request;
+	ping_request["cmd"] = "ping";
+	ping_request["action"] = "";
+	ping_request["data"] = "";
+
+	json proc_request;
+	proc_request["cmd"] = "proc";
+	proc_request["action"] = "get";
+	proc_request["data"] = "";
+
+	// Agents with CAP_STATUS answer this with {"ping": "pong", "processes": {...}, "filter": "..."}
+	json status_request;
+	status_request["cmd"] = "status";
+	status_request["action"] = "";
+	status_request["data"] = "";
+
+	auto results = std::make_shared<PollResults>();
+	for (const auto &el : connections)
+	{
+		results->pending += (processes && !el.second->hasCapability(AgentConnection::CAP_STATUS)) ? 2 : 1;
+	}
 
-		// First, check all processes marked with agent_id in the table
-		// If they dont match any processes in the response, mark them as not monitored
-		stat = m_db.prepareStatement("SELECT id,name FROM processes WHERE agent_id = ?");
-		stat->setInt(1, agent_id);
+	// The last handler stores the results, the DB writer writes them without holding up the next poll
+	auto store = [this, connections, processes, done](std::map<std::string, PollResult> &agents)
+	{
+		PollStates states;
 
-		res = std::unique_ptr<sql::ResultSet>(stat->executeQuery());
-		while (res->next())
+		for (const auto &el : connections)
 		{
-			int proc_id = res->getInt("id");
-			if (!response["response"].count(res->getString("name")))
+			const std::string &agent = el.first;
+			const std::shared_ptr<AgentConnection> &conn = el.second;
+			const PollResult &result = agents[agent];
+
+			states[agent] = std::hash<std::string>()(std::to_string(result.status) + (result.has_processes ? result.processes.dump() : ""));
+
+			// The agent may have reconnected during the poll, what its old connection did says
+			// nothing about the new one
+			if (m_registry.find(agent) != conn)
+			{
+				continue;
+			}
+
+			// Agents with request ids that timed out keep their connection, the late answer is dropped
+			if (result.status != AGENT_RUNNING && !(result.status == AGENT_DEGRADED && conn->isOpen()))
+			{
+				// Its health was reset with it, a failure reported now would bring it back
+				disconnectAgent(agent, conn, result.status);
+				continue;
+			}
+
+			// An answer without the processes that were asked for counts as a failure too
+			if (result.status == AGENT_RUNNING && (!processes || result.has_processes))
+			{
+				m_health.succeeded(agent);
+			}
+			else
+			{
+				m_health.failed(agent);
+			}
+
+			m_db_writer.agentStatus(agent, result.status);
+
+			// Pushed changes are queued as soon as they arrive, one that came after the answer
+			// is already queued and newer
+			if (result.status == AGENT_RUNNING && result.has_processes && !pushedSince(agent, result.received_at))
 			{
-				auto update = m_db.prepareStatement("UPDATE processes SET monitored = 0 WHERE id = ?");
-				update->setInt(1, proc_id);
-				update->execute();
+				m_db_writer.agentProcesses(agent, result.processes, result.observed_at);
 			}
 		}
 
-		// Second, go through all *currently* monitored processes
-		// If a monitored process is already in the table, update its status
-		// If it's not in the table, insert it
-		for (const auto &el : response["response"].items())
+		if (done)
+		{
+			done(states);
+		}
+	};
+
+	// Called with results->mutex locked
+	auto finish_one = [results, store]()
+	{
+		if (--results->pending == 0)
 		{
-			stat = m_db.prepareStatement("SELECT id FROM processes WHERE agent_id = ? AND name = ?");
-			stat->setInt(1, agent_id);
-			stat->setString(2, el.key());
+			store(results->agents);
+		}
+	};
 
-			res = std::unique_ptr<sql::ResultSet>(stat->executeQuery());
-			// Check if monitored process is in the table
-			if (res->first())
+	// Every handler drops pending exactly once, even if the answer is malformed, otherwise
+	// the poll would never finish
+	auto on_ping = [results, finish_one](const std::string &agent, AgentConnection::RequestStatus status, bool pong)
+	{
+		std::lock_guard<std::mutex> lock(results->mutex);
+		PollResult &result = results->agents[agent];
+
+		if (status == AgentConnection::REQUEST_OK && pong)
+		{
+			result.status = AGENT_RUNNING;
+		}
+		else if (status == AgentConnection::REQUEST_TIMED_OUT)
+		{
+			std::cerr << "[AgentManager] Agent \"" << agent << "\" didn't answer in time, marking it degraded\n";
+			result.status = AGENT_DEGRADED;
+		}
+
+		finish_one();
+	};
+
+	auto on_processes = [results, finish_one](const std::string &agent, AgentConnection::RequestStatus status, json processes)
+	{
+		std::lock_guard<std::mutex> lock(results->mutex);
+		PollResult &result = results->agents[agent];
+
+		try
+		{
+			if (status == AgentConnection::REQUEST_OK && isProcessList(processes))
 			{
-				auto update = m_db.prepareStatement("UPDATE processes SET monitored = 1, status = ? WHERE id = ?");
-				update->setInt(1, el.value());
-				update->setInt(2, res->getInt("id"));
-				update->execute();
+				result.has_processes = true;
+				result.processes = std::move(processes);
+				result.received_at = std::chrono::steady_clock::now();
+				result.observed_at = std::time(nullptr);
 			}
 			else
 			{
-				auto insert = m_db.prepareStatement("INSERT INTO processes (agent_id, name, monitored, status) VALUES (?, ?, ?, ?)");
-				insert->setInt(1, agent_id);
-				insert->setString(2, el.key());
-				insert->setInt(3, 1);
-				insert->setInt(4, el.value());
-				insert->execute();
+				std::cerr << "[AgentManager] Failed to get monitored processes from agent \"" << agent << "\"\n";
 			}
 		}
+		catch (json::exception &e)
+		{
+			std::cerr << "[AgentManager] Invalid process list from agent \"" << agent << "\": " << e.what() << "\n";
+			result.has_processes = false;
+		}
+
+		finish_one();
+	};
+
+	// Answer of CAP_STATUS agents, {"ping": "pong", "processes": {...}, "filter": "..."}
+	auto on_status = [results, finish_one](const std::string &agent, AgentConnection::RequestStatus status, json response)
+	{
+		std::lock_guard<std::mutex> lock(results->mutex);
+		PollResult &result = results->agents[agent];
+
+		try
+		{
+			if (status == AgentConnection::REQUEST_OK && response.is_object())
+			{
+				if (response.count("ping") && response["ping"] == "pong")
+				{
+					result.status = AGENT_RUNNING;
+				}
+
+				if (response.count("processes") && isProcessList(response["processes"]))
+				{
+					result.has_processes = true;
+					result.processes = std::move(response["processes"]);
+					result.received_at = std::chrono::steady_clock::now();
+					result.observed_at = std::time(nullptr);
+				}
+			}
+			else if (status == AgentConnection::REQUEST_TIMED_OUT)
+			{
+				std::cerr << "[AgentManager] Agent \"" << agent << "\" didn't answer in time, marking it degraded\n";
+				result.status = AGENT_DEGRADED;
+			}
+		}
+		catch (json::exception &e)
+		{
+			std::cerr << "[AgentManager] Invalid status from agent \"" << agent << "\": " << e.what() << "\n";
+			result.has_processes = false;
+		}
+
+		finish_one();
+	};
+
+	// Poll the agents at once so the poll takes as long as the slowest agent, not the sum of all.
+	// Agents with CAP_STATUS are polled with a single request, others get ping and proc get
+	// (pipelined for agents with request ids). Agents with CAP_HEARTBEAT get a heartbeat frame
+	// instead of the ping. Every request has a deadline, so all of them finish within RequestTimeout.
+	for (const auto &el : connections)
+	{
+		std::string agent = el.first;
+		std::shared_ptr<AgentConnection> conn = el.second;
+
+		if (processes && conn->hasCapability(AgentConnection::CAP_STATUS))
+		{
+			conn->asyncRequest(status_request, m_config.getRequestTimeout(), [on_status, agent](AgentConnection::RequestStatus status, json &response)
+			{
+				on_status(agent, status, getResponse(response));
+			});
+
+			continue;
+		}
+
+		if (conn->hasCapability(AgentConnection::CAP_HEARTBEAT))
+		{
+			conn->asyncHeartbeat(m_config.getRequestTimeout(), [on_ping, agent](AgentConnection::RequestStatus status)
+			{
+				on_ping(agent, status, true);
+			});
+		}
+		else
+		{
+			conn->asyncRequest(ping_request, m_config.getRequestTimeout(), [on_ping, agent](AgentConnection::RequestStatus status, json &response)
+			{
+				on_ping(agent, status, getResponse(response) == "pong");
+			});
+		}
+
+		if (processes)
+		{
+			conn->asyncRequest(proc_request, m_config.getRequestTimeout(), [on_processes, agent](AgentConnection::RequestStatus status, json &response)
+			{
+				on_processes(agent, status, getResponse(response));
+			});
+		}
+	}
+
+	if (connections.empty())
+	{
+		std::map<std::string, PollResult> none;
+		store(none);
+	}
+}
+
+
+bool AgentManager::isProcessList(const json &processes)
+{
+	if (!processes.is_object())
+	{
+		return false;
 	}
-	catch (sql::SQLException &e)
+
+	// Stored as int, anything else would throw in the DB writer
+	for (const auto &el : processes)
 	{
-		std::cerr << "[AgentManager] SQL error while updating processes: " << e.what() << "\n";
-		// No need to return here
+		if (!el.is_boolean() && !el.is_number())
+		{
+			return false;
+		}
 	}
 
 	return true;
 }
 
 
-bool AgentManager::ping(const std::string &agent)
+json AgentManager::getResponse(const json &msg)
+{
+	// Agents that aren't read by request id can send anything, not only objects
+	if (msg.is_object() && msg.count("response"))
+	{
+		return msg["response"];
+	}
+
+	return json();
+}
+
+
+bool AgentManager::updateAgentProcesses(const std::string &agent, bool print)
 {
 	json request;
-	request["cmd"] = "ping";
-	request["action"] = "";
+	request["cmd"] = "proc";
+	request["action"] = "get";
 	request["data"] = "";
 
-	if (!sendMessage(agent, request.dump()))
+	json response;
+	if (!this->request(agent, request, response))
 	{
+		std::cerr << "[AgentManager] Failed to get monitored processes from agent\n";
 		return false;
 	}
 
-	json response;
-	if (!recvMessage(agent, response))
+	if (!isProcessList(response["response"]))
 	{
+		std::cerr << "[AgentManager] Agent \"" << agent << "\" sent an invalid process list\n";
 		return false;
 	}
 
-	return response["response"] == "pong";
+	if (print)
+	{
+		for (const auto &el : response["response"].items())
+		{
+			std::cout << "Process: \"" << el.key() << "\": " << (el.value().get<int>() ? "running" : "not running") << "\n";
+		}
+	}
+
+	m_db_writer.agentProcesses(agent, response["response"]);
+	return true;
 }
 
 
-bool AgentManager::sendMessage(const std::string &agent, const std::string &msg)
+bool AgentManager::sendMessage(const std::string &agent, const json &msg)
 {
-	auto find = m_connections.find(agent);
-	if (find == m_connections.end())
+	std::shared_ptr<AgentConnection> conn = m_registry.find(agent);
+	if (!conn)
 	{
 		std::cerr << "[AgentManager] Agent: " << agent << " not found!\n";
 		return false;
 	}
 
-	try
+	if (!checkHealth(agent))
 	{
-		boost::system::error_code ec;
-		return boost::asio::write(*find->second, boost::asio::buffer(msg), ec);
+		return false;
 	}
-	catch (boost::system::system_error &e)
+
+	AgentConnection::RequestStatus status = conn->send(msg, m_config.getRequestTimeout());
+	if (status == AgentConnection::REQUEST_TIMED_OUT)
 	{
-		std::cerr << "[AgentManager] Failed to send message: " << e.what() << "\n";
-		return false;
+		std::cerr << "[AgentManager] Agent \"" << agent << "\" didn't accept message in time, marking it degraded\n";
+		handleTimeout(agent, conn);
 	}
+
+	reportHealth(agent, conn, status == AgentConnection::REQUEST_OK);
+	return status == AgentConnection::REQUEST_OK;
 }
 
 
-bool AgentManager::recvMessage(const std::string &agent, json &out)
+bool AgentManager::request(const std::string &agent, const json &msg, json &response)
 {
-	auto find = m_connections.find(agent);
-	if (find == m_connections.end())
+	std::shared_ptr<AgentConnection> conn = m_registry.find(agent);
+	if (!conn)
 	{
-		std::cerr << "[AgentManager] Agent: " << agent << " not found!" << std::endl;
+		std::cerr << "[AgentManager] Agent: " << agent << " not found!\n";
 		return false;
 	}
 
-	try
+	if (!checkHealth(agent))
 	{
-		boost::system::error_code error;
-		char buffer[MAX_BUFFER_SIZE] = { 0 };
+		return false;
+	}
 
-		size_t no_received = find->second->read_some(boost::asio::buffer(buffer), error);
-		if (no_received)
-		{
-			std::string outbuf(buffer, no_received);
-			out = json::parse(outbuf);
+	AgentConnection::RequestStatus status = conn->request(msg, m_config.getRequestTimeout(), response);
+	if (status == AgentConnection::REQUEST_TIMED_OUT)
+	{
+		std::cerr << "[AgentManager] Agent \"" << agent << "\" didn't answer in time, marking it degraded\n";
+		handleTimeout(agent, conn);
+	}
 
-			// Every received message that doesn't contain "response" key is invalid
-			if (!out.count("response"))
-			{
-				return false;
-			}
+	// Every received message that doesn't contain "response" key is invalid
+	bool ok = status == AgentConnection::REQUEST_OK && response.count("response");
+	reportHealth(agent, conn, ok);
+	return ok;
+}
 
-			return true;
-		}
-		else
-		{
-			return false;
-		}
+
+void AgentManager::reportHealth(const std::string &agent, const std::shared_ptr<AgentConnection> &conn, bool ok)
+{
+	// A connection that was removed or replaced meanwhile doesn't count
+	if (m_registry.find(agent) != conn)
+	{
+		return;
 	}
-	catch (json::exception &e)
+
+	if (ok)
 	{
-		std::cerr << "[AgentManager] Failed to parse message with JSON: " << e.what() << "\n";
-		return false;
+		m_health.succeeded(agent);
 	}
-	catch (boost::system::system_error &e)
+	else
 	{
-		std::cerr << "[AgentManager] Failed to receive message: " << e.what() << "\n";
+		m_health.failed(agent);
+	}
+}
+
+
+bool AgentManager::checkHealth(const std::string &agent)
+{
+	if (m_health.check(agent) == AgentHealth::REJECT)
+	{
+		std::cerr << "[AgentManager] Agent \"" << agent << "\" keeps failing requests, not sending anything to it until it's probed again\n";
 		return false;
 	}
+
+	return true;
 }
 
 
-void AgentManager::addAgentToDb(const std::string &agent)
+void AgentManager::handleTimeout(const std::string &agent, const std::shared_ptr<AgentConnection> &conn)
 {
-	auto stat = m_db.prepareStatement("SELECT id FROM agents WHERE name = ?");
-	stat->setString(1, agent);
+	// Legacy agents lose their connection on timeout, agents with request ids keep it
+	if (!conn->isOpen())
+	{
+		disconnectAgent(agent, conn, AGENT_DEGRADED);
+		return;
+	}
 
-	std::unique_ptr<sql::ResultSet> res(stat->executeQuery());
-	if (!res->first())
+	// Not if the agent has reconnected meanwhile
+	if (m_registry.find(agent) == conn)
 	{
-		auto insert = m_db.prepareStatement("INSERT INTO agents (name, ip, status) VALUES (?, ?, ?)");
-		insert->setString(1, agent);
-		insert->setString(2, getAgentIp(agent));
-		insert->setInt(3, 1); // 0 = not running, 1 = running
-		insert->execute();
+		m_db_writer.agentStatus(agent, AGENT_DEGRADED);
 	}
-	else
+}
+
+
+void AgentManager::disconnectAgent(const std::string &agent, const std::shared_ptr<AgentConnection> &conn, int status)
+{
+	conn->close();
+
+	// The agent may have reconnected in the meantime
+	if (!m_registry.remove(agent, conn))
 	{
-		auto update = m_db.prepareStatement("UPDATE agents SET last_updated = now() WHERE id = ?");
-		update->setInt(1, res->getInt("id"));
-		update->execute();
+		return;
 	}
+
+	forgetAgent(agent);
+	m_db_writer.agentStatus(agent, status);
+}
+
+
+void AgentManager::forgetAgent(const std::string &agent)
+{
+	m_health.reset(agent);
+
+	std::lock_guard<std::mutex> lock(m_subscribed_mutex);
+	m_subscribed.erase(agent);
+	m_last_event.erase(agent);
+}
+
+
+void AgentManager::subscribeEvents(const std::string &agent, const std::shared_ptr<AgentConnection> &conn)
+{
+	conn->setEventHandler([this, agent](json &event)
+	{
+		handleEvent(agent, event);
+	});
+
+	json request;
+	request["cmd"] = "subscribe";
+	request["action"] = "proc";
+	request["data"] = "";
+
+	std::weak_ptr<AgentConnection> weak = conn;
+	conn->asyncRequest(request, m_config.getRequestTimeout(), [this, agent, weak](AgentConnection::RequestStatus status, json &response)
+	{
+		if (status != AgentConnection::REQUEST_OK || getResponse(response) != "ok")
+		{
+			std::cerr << "[AgentManager] Agent \"" << agent << "\" didn't subscribe to process changes, polling it\n";
+			return;
+		}
+
+		// Agent reconnected meanwhile, the new connection subscribes on its own
+		std::shared_ptr<AgentConnection> subscribed = weak.lock();
+		if (!subscribed || m_registry.find(agent) != subscribed)
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_subscribed_mutex);
+			m_subscribed[agent] = std::chrono::steady_clock::now() + std::chrono::seconds(m_config.getReconcileInterval());
+		}
+
+		// Still checked to be alive every UpdateInterval, its state only changes with the events
+		// now. Critical agents are polled often anyway.
+		if (!m_config.isCriticalAgent(agent))
+		{
+			m_scheduler.schedule(agent, std::chrono::seconds(m_config.getAgentUpdateInterval()), false);
+		}
+	});
 }
 
 
-bool AgentManager::updateAgentStatus(const std::string &agent, int status)
+bool AgentManager::reconcileDue(const std::string &agent)
 {
-	auto stat = m_db.prepareStatement("SELECT id FROM agents WHERE name = ?");
-	stat->setString(1, agent);
+	std::lock_guard<std::mutex> lock(m_subscribed_mutex);
+
+	auto find = m_subscribed.find(agent);
+	if (find == m_subscribed.end())
+	{
+		return true;
+	}
 
-	std::unique_ptr<sql::ResultSet> res(stat->executeQuery());
-	if (!res->first())
+	auto now = std::chrono::steady_clock::now();
+	if (now < find->second)
 	{
 		return false;
 	}
 
-	auto update = m_db.prepareStatement("UPDATE agents SET last_updated = now(), status = ? WHERE id = ?");
-	update->setInt(1, status);
-	update->setInt(2, res->getInt("id"));
+	find->second = now + std::chrono::seconds(m_config.getReconcileInterval());
+	return true;
+}
 
-	// ->execute() actually returns 0 on success and 1 on fail, nice library
-	return !update->execute();
+
+bool AgentManager::pushedSince(const std::string &agent, std::chrono::steady_clock::time_point since)
+{
+	std::lock_guard<std::mutex> lock(m_subscribed_mutex);
+
+	auto find = m_last_event.find(agent);
+	return find != m_last_event.end() && find->second > since;
 }
 
 
-void AgentManager::addConnection(const std::string &agent, std::unique_ptr<boost::asio::ip::tcp::socket> conn)
+void AgentManager::handleEvent(const std::string &agent, json &event)
 {
-	m_connections[agent] = std::move(conn);
+	// The event has the complete process list, it's stored the same way as a polled one
+	if (event["event"] == "proc" && isProcessList(event["data"]))
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_subscribed_mutex);
+			m_last_event[agent] = std::chrono::steady_clock::now();
+		}
+
+		m_db_writer.agentProcesses(agent, event["data"]);
+		return;
+	}
+
+	std::cerr << "[AgentManager] Unknown event from agent \"" << agent << "\": " << event.dump() << "\n";
 }
 
 
-std::vector<std::string> AgentManager::getAgents() const
+void AgentManager::addConnection(const std::string &agent, std::shared_ptr<AgentConnection> conn)
+{
+	// Agents that are read all the time (request ids) are noticed as soon as they go away,
+	// the others on their next poll
+	std::weak_ptr<AgentConnection> weak = conn;
+	conn->setCloseHandler([this, agent, weak]()
+	{
+		if (std::shared_ptr<AgentConnection> lost = weak.lock())
+		{
+			std::cerr << "[AgentManager] Agent \"" << agent << "\" closed the connection\n";
+			disconnectAgent(agent, lost, AGENT_NOT_RUNNING);
+		}
+	});
+
+	std::shared_ptr<AgentConnection> previous = m_registry.add(agent, conn);
+
+	// An agent that reconnected starts over, whatever was agreed with the old connection doesn't hold
+	forgetAgent(agent);
+	m_scheduler.remove(agent);
+
+	if (m_config.isCriticalAgent(agent))
+	{
+		m_scheduler.schedule(agent, std::chrono::seconds(m_config.getMinUpdateInterval()), false);
+	}
+	else
+	{
+		m_scheduler.schedule(agent, std::chrono::seconds(m_config.getAgentUpdateInterval()));
+	}
+
+	if (conn->hasCapability(AgentConnection::CAP_EVENTS))
+	{
+		subscribeEvents(agent, conn);
+	}
+
+	// Agent reconnected, drop the old connection
+	if (previous)
+	{
+		previous->close();
+	}
+}
+
+
+std::vector<std::string> AgentManager::getAgents()
 {
 	std::vector<std::string> agents;
 
-	for (auto &conn : m_connections)
+	for (auto &conn : m_registry.snapshot())
 	{
 		agents.push_back(conn.first);
 	}
 
 	return agents;
 }
+
+
+std::string AgentManager::getAgentIp(const std::string &agent)
+{
+	std::shared_ptr<AgentConnection> conn = m_registry.find(agent);
+	return conn ? conn->getIp() : "";
+}
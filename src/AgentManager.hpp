@@ -2,6 +2,7 @@
 
 #include <boost/asio.hpp>
 #include <boost/thread.hpp>
+#include <functional>
 #include <mutex>
 #include <memory>
 #include <map>
@@ -10,9 +11,14 @@
 #include <vector>
 
 #include "json.hpp"
-#include "MySqlJdbcConnector.hpp"
+#include "AgentConnection.hpp"
+#include "AgentHealth.hpp"
+#include "AgentRegistry.hpp"
+#include "StorageBackend.hpp"
 #include "pugixml.hpp"
 #include "Configuration.hpp"
+#include "DbWriter.hpp"
+#include "PollScheduler.hpp"
 
 
 using json = nlohmann::json;
@@ -20,28 +26,107 @@ using json = nlohmann::json;
 
 class AgentManager
 {
+public:
+	// Agent status as stored in the agents table
+	enum AgentStatus : int
+	{
+		AGENT_NOT_RUNNING = 0,
+		AGENT_RUNNING = 1,
+		// Agent didn't answer a request in time, its connection was closed
+		AGENT_DEGRADED = 2
+	};
+
 private:
-	std::mutex m_control_mutex;
-	boost::thread m_main_thread;
+	// Threads running m_io_service (accepting agents and handling their identification)
+	boost::thread_group m_io_threads;
 
 	uint16_t m_discover_port;
 	uint16_t m_server_port;
 
     Configuration m_config;
 
-	MySqlJdbcConnector m_db;
+	std::unique_ptr<StorageBackend> m_storage;
+	DbWriter m_db_writer;
 
 	std::unique_ptr<boost::asio::ip::tcp::acceptor> m_acceptor;
 	boost::asio::io_service m_io_service;
-
-	std::map<std::string, std::unique_ptr<boost::asio::ip::tcp::socket>> m_connections;
-
-	// If agent with that name doesn't exist, create a new record
-	// If it does exist, update last_updated
-	void addAgentToDb(const std::string &agent);
-	bool updateAgentStatus(const std::string &agent, int status);
+	// Keeps m_io_service::run() from returning when there is no pending work
+	std::unique_ptr<boost::asio::io_service::work> m_io_work;
+	// Delays accepting again after a failed accept, only used by the accept handler
+	boost::asio::steady_timer m_accept_timer;
+
+	AgentRegistry m_registry;
+	// Due times of the periodic polls, every connected agent has one
+	PollScheduler m_scheduler;
+	// Agents that keep failing requests are left alone for a while
+	AgentHealth m_health;
+
+	// Next process poll of every agent that pushes its process changes, the polls in between
+	// only check it's alive
+	std::mutex m_subscribed_mutex;
+	std::map<std::string, std::chrono::steady_clock::time_point> m_subscribed;
+	// When the last process change was pushed by every agent, guarded by m_subscribed_mutex
+	std::map<std::string, std::chrono::steady_clock::time_point> m_last_event;
+
+	using Connections = std::vector<std::pair<std::string, std::shared_ptr<AgentConnection>>>;
+
+	// Fingerprint of the status and processes found by a poll, by agent
+	using PollStates = std::map<std::string, size_t>;
+
+	// Sends ping (and proc get if processes is true) to the agents concurrently without waiting
+	// for the answers. When the last one is in, the results are queued for the DB writer, agents
+	// that didn't answer are disconnected and done is called from an io thread.
+	void pollAgents(const Connections &connections, bool processes, std::function<void(const PollStates &states)> done);
+
+	// Subscribes to process changes of an agent with CAP_EVENTS, once it agrees its processes
+	// are polled only every ReconcileInterval
+	void subscribeEvents(const std::string &agent, const std::shared_ptr<AgentConnection> &conn);
+	void handleEvent(const std::string &agent, json &event);
+	// Returns true if the poll of the agent should get its processes
+	bool reconcileDue(const std::string &agent);
+	// Returns true if the agent pushed a process change after the given time, processes polled
+	// before it are older than what's stored
+	bool pushedSince(const std::string &agent, std::chrono::steady_clock::time_point since);
+	// Drops what is kept about an agent whose connection was removed or replaced, health included
+	void forgetAgent(const std::string &agent);
+
+	// Closes the agent's connection and records its status
+	void disconnectAgent(const std::string &agent, const std::shared_ptr<AgentConnection> &conn, int status);
+	void handleTimeout(const std::string &agent, const std::shared_ptr<AgentConnection> &conn);
+	// Returns false (and says why) if the agent's circuit is open
+	bool checkHealth(const std::string &agent);
+	void reportHealth(const std::string &agent, const std::shared_ptr<AgentConnection> &conn, bool ok);
+	// "response" of an agent's answer, null if the answer isn't an object or has none
+	static json getResponse(const json &msg);
+	// Object of process name -> running (boolean or number), as the storage expects it
+	static bool isProcessList(const json &processes);
 
 	static const int MAX_BUFFER_SIZE{ 1024 };
+	// Seconds between checks for process history to roll up
+	static const unsigned int ROLLUP_INTERVAL{ 60 };
+	// Seconds a connected peer has to identify itself before it's dropped
+	static const unsigned int IDENTIFICATION_TIMEOUT{ 10 };
+	// Milliseconds to wait before accepting again after an accept failed (e.g. out of file descriptors)
+	static const unsigned int ACCEPT_RETRY_DELAY{ 100 };
+
+	// Connection that was accepted but the agent hasn't identified itself yet
+	struct PendingAgent
+	{
+		PendingAgent(boost::asio::io_service &io_service) : strand{ io_service }, timer{ io_service } {}
+
+		// Serializes the identification and the deadline, they both touch conn
+		boost::asio::io_service::strand strand;
+		boost::asio::steady_timer timer;
+		std::unique_ptr<boost::asio::ip::tcp::socket> conn;
+		char buffer[MAX_BUFFER_SIZE];
+		// Answer to the identification, kept until it's written
+		std::string accept;
+	};
+
+	void startAccept();
+	void handleAccept(std::shared_ptr<PendingAgent> pending, const boost::system::error_code &ec);
+	void handleIdentification(std::shared_ptr<PendingAgent> pending, const boost::system::error_code &ec, size_t n_received);
+	void establishConnection(std::shared_ptr<PendingAgent> pending, const std::string &agent, unsigned int capabilities);
 
 public:
 	AgentManager(uint16_t discover_port, uint16_t server_port);
@@ -53,18 +138,22 @@ public:
 
 	void run();
 	void join();
-	void lock() { m_control_mutex.lock(); }
-	void unlock() { m_control_mutex.unlock(); }
 	
+	// Pings all agents concurrently, agents that don't answer are disconnected
 	void refreshAgentStatuses();
+	// Gets monitored processes from the agent and stores them in DB
 	bool updateAgentProcesses(const std::string &agent, bool print = false);
-	bool ping(const std::string &agent);
 
-	bool sendMessage(const std::string &agent, const std::string &msg);
-	bool recvMessage(const std::string &agent, json &out);
+	// Agents that don't accept the message or answer the request within RequestTimeout
+	// are marked degraded
+	bool sendMessage(const std::string &agent, const json &msg);
+	bool request(const std::string &agent, const json &msg, json &response);
 	
-	bool isConnected(const std::string &agent) const { return m_connections.count(agent); }
-	void addConnection(const std::string &agent, std::unique_ptr<boost::asio::ip::tcp::socket> conn);
-	std::string getAgentIp(const std::string &agent) const { return m_connections.at(agent)->remote_endpoint().address().to_string(); }
-	std::vector<std::string> getAgents() const;
+	bool isConnected(const std::string &agent) { return m_registry.contains(agent); }
+	void addConnection(const std::string &agent, std::shared_ptr<AgentConnection> conn);
+	std::string getAgentIp(const std::string &agent);
+	std::vector<std::string> getAgents();
+	AgentHealth::State getAgentHealth(const std::string &agent) { return m_health.getState(agent); }
+
+	DbWriter::Stats getDbStats() { return m_db_writer.getStats(); }
 };
@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <functional>
+
+#include "AgentRegistry.hpp"
+
+
+AgentRegistry::Shard &AgentRegistry::getShard(const std::string &agent)
+{
+	return m_shards[std::hash<std::string>()(agent) % SHARD_COUNT];
+}
+
+
+std::shared_ptr<AgentConnection> AgentRegistry::add(const std::string &agent, std::shared_ptr<AgentConnection> conn)
+{
+	Shard &shard = getShard(agent);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	std::shared_ptr<AgentConnection> &slot = shard.connections[agent];
+	std::shared_ptr<AgentConnection> previous = std::move(slot);
+	slot = std::move(conn);
+
+	return previous;
+}
+
+
+bool AgentRegistry::remove(const std::string &agent, const std::shared_ptr<AgentConnection> &conn)
+{
+	Shard &shard = getShard(agent);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto find = shard.connections.find(agent);
+	if (find == shard.connections.end() || find->second != conn)
+	{
+		return false;
+	}
+
+	shard.connections.erase(find);
+	return true;
+}
+
+
+std::shared_ptr<AgentConnection> AgentRegistry::find(const std::string &agent)
+{
+	Shard &shard = getShard(agent);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+
+	auto find = shard.connections.find(agent);
+	if (find == shard.connections.end())
+	{
+		return nullptr;
+	}
+
+	return find->second;
+}
+
+
+bool AgentRegistry::contains(const std::string &agent)
+{
+	return find(agent) != nullptr;
+}
+
+
+std::vector<std::pair<std::string, std::shared_ptr<AgentConnection>>> AgentRegistry::snapshot()
+{
+	std::vector<std::pair<std::string, std::shared_ptr<AgentConnection>>> agents;
+
+	for (Shard &shard : m_shards)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		agents.insert(agents.end(), shard.connections.begin(), shard.connections.end());
+	}
+
+	std::sort(agents.begin(), agents.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+	return agents;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "AgentConnection.hpp"
+
+
+// Connected agents by name
+//
+// The agents are spread over shards by the hash of their name, each shard has its own mutex,
+// so threads working with different agents rarely contend. The mutexes only guard the maps,
+// they are never held while talking to an agent.
+class AgentRegistry
+{
+public:
+	static const size_t SHARD_COUNT{ 16 };
+
+private:
+	struct Shard
+	{
+		std::mutex mutex;
+		std::map<std::string, std::shared_ptr<AgentConnection>> connections;
+	};
+
+	std::array<Shard, SHARD_COUNT> m_shards;
+
+	Shard &getShard(const std::string &agent);
+
+public:
+	// Returns the connection the agent had before (if any), so the caller can close it
+	std::shared_ptr<AgentConnection> add(const std::string &agent, std::shared_ptr<AgentConnection> conn);
+
+	// Removes the agent only if conn is still its connection, an agent that reconnected
+	// in the meantime keeps the new one
+	bool remove(const std::string &agent, const std::shared_ptr<AgentConnection> &conn);
+
+	// Returns nullptr if the agent isn't connected
+	std::shared_ptr<AgentConnection> find(const std::string &agent);
+	bool contains(const std::string &agent);
+
+	// Copy of all agents and their connections, sorted by name
+	std::vector<std::pair<std::string, std::shared_ptr<AgentConnection>>> snapshot();
+};
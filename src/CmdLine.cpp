@@ -14,6 +14,7 @@ stop <agent> -> stop agent\n\
 start <agent> -> start agent\n\
 filter <agent> get|set <filter> -> get/set filter on agent\n\
 proc <agent> get|add <process>|del <process> -> manipulate monitored processes on agent\n\
+stats -> state of the database write queue\n\
 ";
 
 
@@ -84,33 +85,46 @@ void CmdLine::run()
 				int c = 1;
 				for (auto &agent : agents)
 				{
-					std::cout << c << ". " << agent << " (" << m_manager.getAgentIp(agent) << ")\n";
+					std::cout << c << ". " << agent << " (" << m_manager.getAgentIp(agent) << ")";
+
+					AgentHealth::State health = m_manager.getAgentHealth(agent);
+					if (health == AgentHealth::DEGRADED)
+					{
+						std::cout << " - failing requests";
+					}
+					else if (health == AgentHealth::OPEN)
+					{
+						std::cout << " - not answering, backing off";
+					}
+
+					std::cout << "\n";
 					c++;
 				}
 			}
+			else if (cmd == "stats")
+			{
+				DbWriter::Stats stats = m_manager.getDbStats();
+
+				std::cout << "DB queue: " << stats.queue_depth << "/" << stats.queue_capacity << " (oldest " << stats.queue_lag.count() << " ms)\n";
+				std::cout << "Last write lag: " << stats.write_lag.count() << " ms\n";
+				std::cout << "Written: " << stats.written << ", dropped: " << stats.dropped << ", failed: " << stats.failed << "\n";
+				std::cout << "Spooled: " << stats.spooled << "\n";
+			}
 			else if (cmd == "start")
 			{
-				m_manager.lock();
 				cmd_start(agent, tokens);
-				m_manager.unlock();
 			}
 			else if (cmd == "stop")
 			{
-				m_manager.lock();
 				cmd_start(agent, tokens);
-				m_manager.unlock();
 			}
 			else if (cmd == "filter")
 			{
-				m_manager.lock();
 				cmd_filter(agent, tokens);
-				m_manager.unlock();
 			}
 			else if (cmd == "proc")
 			{
-				m_manager.lock();
 				cmd_proc(agent, tokens);
-				m_manager.unlock();
 			}
 			else {
 				std::cerr << "Wrong command\n";
@@ -139,7 +153,7 @@ bool CmdLine::cmd_start(const std::string &agent, const std::vector<std::string>
 	d["action"] = "";
 	d["data"] = "";
 
-	return m_manager.sendMessage(agent, d.dump());
+	return m_manager.sendMessage(agent, d);
 }
 
 
@@ -156,7 +170,7 @@ bool CmdLine::cmd_stop(const std::string &agent, const std::vector<std::string>
 	d["action"] = "";
 	d["data"] = "";
 
-	return m_manager.sendMessage(agent, d.dump());
+	return m_manager.sendMessage(agent, d);
 }
 
 
@@ -176,14 +190,8 @@ bool CmdLine::cmd_filter(const std::string &agent, const std::vector<std::string
 		msg["action"] = action;
 		msg["data"] = "";
 
-		if (!m_manager.sendMessage(agent, msg.dump()))
-		{
-			std::cerr << "Failed to send get filter command to agent \"" << agent << "\"\n";
-			return false;
-		}
-
 		json response;
-		if (!m_manager.recvMessage(agent, response))
+		if (!m_manager.request(agent, msg, response))
 		{
 			std::cerr << "Failed to receive filter from agent \"" << agent << "\"\n";
 			return false;
@@ -215,14 +223,8 @@ bool CmdLine::cmd_filter(const std::string &agent, const std::vector<std::string
 		msg["action"] = action;
 		msg["data"] = filter;
 
-		if (!m_manager.sendMessage(agent, msg.dump()))
-		{
-			std::cerr << "Failed to send filter to agent " << agent << "\n";
-			return false;
-		}
-
 		json response;
-		if (!m_manager.recvMessage(agent, response))
+		if (!m_manager.request(agent, msg, response))
 		{
 			std::cerr << "Failed to receive response to filter change from agent " << agent << "\n";
 			return false;
@@ -277,14 +279,8 @@ bool CmdLine::cmd_proc(const std::string &agent, const std::vector<std::string>
 		msg["action"] = "add";
 		msg["data"] = process;
 
-		if (!m_manager.sendMessage(agent, msg.dump()))
-		{
-			std::cerr << "Failed to send request to add a monitored process\n";
-			return false;
-		}
-
 		json response;
-		if (!m_manager.recvMessage(agent, response))
+		if (!m_manager.request(agent, msg, response))
 		{
 			std::cerr << "Failed to receive response to process add\n";
 			return false;
@@ -316,14 +312,8 @@ bool CmdLine::cmd_proc(const std::string &agent, const std::vector<std::string>
 		msg["action"] = "del";
 		msg["data"] = process;
 
-		if (!m_manager.sendMessage(agent, msg.dump()))
-		{
-			std::cerr << "Failed to send request to remove a monitored process\n";
-			return false;
-		}
-
 		json response;
-		if (!m_manager.recvMessage(agent, response))
+		if (!m_manager.request(agent, msg, response))
 		{
 			std::cerr << "Failed to receive response to process remove\n";
 			return false;
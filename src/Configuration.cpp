@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iostream>
 #include <boost/filesystem.hpp>
 
@@ -39,7 +40,92 @@ bool Configuration::parse(const std::string &xml_config)
 		m_agent_update_interval = configuration.child("UpdateInterval").text().as_uint();
 	}
 
+	// Limits that aren't configured leave room for UpdateInterval, configurations from before
+	// they existed keep polling at their interval
+	if (configuration.child("MinUpdateInterval"))
+	{
+		m_min_update_interval = configuration.child("MinUpdateInterval").text().as_uint();
+	}
+	else
+	{
+		m_min_update_interval = std::min(m_min_update_interval, std::max(m_agent_update_interval, 1u));
+	}
+
+	if (configuration.child("MaxUpdateInterval"))
+	{
+		m_max_update_interval = configuration.child("MaxUpdateInterval").text().as_uint();
+	}
+	else
+	{
+		m_max_update_interval = std::max(m_max_update_interval, m_agent_update_interval);
+	}
+
+	if (!m_min_update_interval || m_min_update_interval > m_max_update_interval)
+	{
+		std::cerr << "[Configuration] Invalid configuration: MinUpdateInterval has to be at least 1 and at most MaxUpdateInterval\n";
+		return false;
+	}
+
+	// The interval of a new agent is within the limits
+	unsigned int update_interval = std::min(std::max(m_agent_update_interval, m_min_update_interval), m_max_update_interval);
+	if (update_interval != m_agent_update_interval)
+	{
+		std::cerr << "[Configuration] UpdateInterval " << m_agent_update_interval << " is outside of MinUpdateInterval and MaxUpdateInterval, using " << update_interval << "\n";
+		m_agent_update_interval = update_interval;
+	}
+
+	for (pugi::xml_node agent : configuration.child("CriticalAgents").children("Agent"))
+	{
+		m_critical_agents.insert(agent.text().as_string());
+	}
+
+	if (configuration.child("ReconcileInterval"))
+	{
+		m_reconcile_interval = configuration.child("ReconcileInterval").text().as_uint();
+	}
+
+	if (configuration.child("RequestTimeout"))
+	{
+		m_request_timeout = configuration.child("RequestTimeout").text().as_uint();
+	}
+
+	if (configuration.child("IoThreads"))
+	{
+		m_io_threads = configuration.child("IoThreads").text().as_uint();
+	}
+
+	if (configuration.child("DbQueueSize"))
+	{
+		m_db_queue_size = configuration.child("DbQueueSize").text().as_uint();
+	}
+
+	if (configuration.child("SpoolDir"))
+	{
+		m_spool_dir = configuration.child("SpoolDir").text().as_string();
+	}
+
+	if (configuration.child("SpoolSize"))
+	{
+		m_spool_size = configuration.child("SpoolSize").text().as_uint();
+	}
+
+	if (configuration.child("Storage"))
+	{
+		m_storage = configuration.child("Storage").text().as_string();
+	}
+
+	if (m_storage != "mysql" && m_storage != "memory")
+	{
+		std::cerr << "[Configuration] Invalid configuration: unknown Storage \"" << m_storage << "\", expected mysql or memory\n";
+		return false;
+	}
+
 	pugi::xml_node database = configuration.child("MysqlDatabase");
+	if (!database && m_storage == "memory")
+	{
+		return true;
+	}
+
 	if (!database)
 	{
 		std::cerr << "[Configuration] Invalid configuration: missing MysqlDatabase section in Configuration\n";
@@ -67,5 +153,10 @@ bool Configuration::parse(const std::string &xml_config)
 		m_db_name = database.child("Name").text().as_string();
 	}
 
+	if (database.child("PoolSize"))
+	{
+		m_db_pool_size = database.child("PoolSize").text().as_uint();
+	}
+
 	return true;
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <set>
 #include <string>
 
 
@@ -11,8 +12,37 @@ private:
 	std::string m_db_password;
 	std::string m_db_name;
 
-	// Agent status and monitored processes are updated in this interval
+	// Agent status and monitored processes are updated in this interval, agents are polled
+	// at different times within it
 	unsigned int m_agent_update_interval{ 10 };
+	// Limits of the interval of a single agent, it's polled more often while its state
+	// changes and less often while it doesn't. UpdateInterval is the interval of a new agent.
+	unsigned int m_min_update_interval{ 2 };
+	unsigned int m_max_update_interval{ 60 };
+	// Agents always polled at m_min_update_interval
+	std::set<std::string> m_critical_agents;
+	// Agents that push process changes are still polled in this interval, to catch missed changes
+	unsigned int m_reconcile_interval{ 300 };
+
+	// Deadline for a single request to an agent, in milliseconds
+	unsigned int m_request_timeout{ 5000 };
+
+	// Number of threads serving agent connections, 0 = one per CPU core
+	unsigned int m_io_threads{ 0 };
+
+	// Maximum number of agent state changes waiting for the DB writer
+	unsigned int m_db_queue_size{ 10000 };
+
+	// Where agent states are stored: "mysql" or "memory"
+	std::string m_storage{ "mysql" };
+
+	// Directory for changes that couldn't be written while the database was down
+	std::string m_spool_dir{ "spool" };
+	// Maximum number of changes kept in the spool, changes beyond it are dropped
+	unsigned int m_spool_size{ 100000 };
+
+	// Number of database connections, each one is used by its own writer thread
+	unsigned int m_db_pool_size{ 2 };
 
 public:
 	Configuration();
@@ -23,4 +53,15 @@ public:
 	const std::string &getDbPassword() const { return m_db_password; }
 	const std::string &getDbName() const { return m_db_name; }
 	unsigned int getAgentUpdateInterval() const { return m_agent_update_interval; }
+	unsigned int getMinUpdateInterval() const { return m_min_update_interval; }
+	unsigned int getMaxUpdateInterval() const { return m_max_update_interval; }
+	bool isCriticalAgent(const std::string &agent) const { return m_critical_agents.count(agent) != 0; }
+	unsigned int getReconcileInterval() const { return m_reconcile_interval; }
+	unsigned int getRequestTimeout() const { return m_request_timeout; }
+	unsigned int getIoThreads() const { return m_io_threads; }
+	unsigned int getDbQueueSize() const { return m_db_queue_size; }
+	unsigned int getDbPoolSize() const { return m_db_pool_size; }
+	const std::string &getSpoolDir() const { return m_spool_dir; }
+	unsigned int getSpoolSize() const { return m_spool_size; }
+	const std::string &getStorage() const { return m_storage; }
 };
\ No newline at end of file
@@ -0,0 +1,167 @@
+#include <boost/filesystem.hpp>
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "DbSpool.hpp"
+
+
+DbSpool::DbSpool(const std::string &path) :
+	m_path{ path }
+{
+	// Count what's left from the last run
+	load();
+}
+
+
+DbSpool::~DbSpool()
+{
+	close();
+}
+
+
+bool DbSpool::open()
+{
+	if (!m_file)
+	{
+		m_file = std::fopen(m_path.c_str(), "ab");
+		if (!m_file)
+		{
+			std::cerr << "[DbSpool] Couldn't open \"" << m_path << "\"\n";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+void DbSpool::close()
+{
+	if (m_file)
+	{
+		std::fclose(m_file);
+		m_file = nullptr;
+	}
+}
+
+
+bool DbSpool::sync(FILE *file)
+{
+	if (std::fflush(file))
+	{
+		return false;
+	}
+
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+
+bool DbSpool::append(const std::vector<json> &records)
+{
+	if (records.empty())
+	{
+		return true;
+	}
+
+	if (!open())
+	{
+		return false;
+	}
+
+	std::string data;
+	for (const auto &record : records)
+	{
+		data += record.dump() + "\n";
+	}
+
+	bool ok = std::fwrite(data.data(), 1, data.size(), m_file) == data.size() && sync(m_file);
+	if (!ok)
+	{
+		std::cerr << "[DbSpool] Failed to write to \"" << m_path << "\"\n";
+		return false;
+	}
+
+	m_count += records.size();
+	return true;
+}
+
+
+std::vector<json> DbSpool::load()
+{
+	std::vector<json> records;
+
+	std::ifstream file(m_path, std::ios::binary);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		try
+		{
+			records.push_back(json::parse(line));
+		}
+		catch (json::exception &e)
+		{
+			std::cerr << "[DbSpool] Skipping broken record in \"" << m_path << "\": " << e.what() << "\n";
+		}
+	}
+
+	m_count = records.size();
+	return records;
+}
+
+
+bool DbSpool::replace(const std::vector<json> &records)
+{
+	close();
+
+	boost::system::error_code ec;
+	if (records.empty())
+	{
+		boost::filesystem::remove(m_path, ec);
+		m_count = 0;
+		return !ec;
+	}
+
+	// Write a new file next to the old one and swap them, so a crash leaves one of them complete
+	std::string tmp_path = m_path + ".tmp";
+	FILE *tmp = std::fopen(tmp_path.c_str(), "wb");
+	if (!tmp)
+	{
+		std::cerr << "[DbSpool] Couldn't open \"" << tmp_path << "\"\n";
+		return false;
+	}
+
+	std::string data;
+	for (const auto &record : records)
+	{
+		data += record.dump() + "\n";
+	}
+
+	bool ok = std::fwrite(data.data(), 1, data.size(), tmp) == data.size() && sync(tmp);
+	std::fclose(tmp);
+
+	if (ok)
+	{
+		boost::filesystem::rename(tmp_path, m_path, ec);
+		ok = !ec;
+	}
+
+	if (!ok)
+	{
+		std::cerr << "[DbSpool] Failed to write \"" << m_path << "\"\n";
+		boost::filesystem::remove(tmp_path, ec);
+		return false;
+	}
+
+	m_count = records.size();
+	return true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+
+
+using json = nlohmann::json;
+
+
+// Append-only file of database changes that couldn't be written, one JSON document per line
+//
+// Every append is synced to disk once, so changes survive a crash of the monitor while
+// the database is down.
+class DbSpool
+{
+private:
+	std::string m_path;
+	FILE *m_file{ nullptr };
+	size_t m_count{ 0 };
+
+	bool open();
+	void close();
+	static bool sync(FILE *file);
+
+public:
+	DbSpool(const std::string &path);
+	~DbSpool();
+
+	DbSpool(const DbSpool &) = delete;
+	DbSpool &operator=(const DbSpool &) = delete;
+
+	// Records that couldn't be written aren't counted
+	bool append(const std::vector<json> &records);
+	// Lines that can't be parsed (e.g. cut off by a crash) are skipped
+	std::vector<json> load();
+	// Atomically replaces the content of the spool, empty records remove the file
+	bool replace(const std::vector<json> &records);
+
+	bool empty() const { return m_count == 0; }
+	// Records in the file
+	size_t count() const { return m_count; }
+	const std::string &getPath() const { return m_path; }
+};
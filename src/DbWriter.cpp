@@ -0,0 +1,465 @@
+#include <boost/filesystem.hpp>
+#include <algorithm>
+#include <functional>
+#include <iostream>
+
+#include "DbWriter.hpp"
+
+
+const size_t DbWriter::TRANSACTION_SIZE;
+
+
+DbWriter::DbWriter()
+{
+	;
+}
+
+
+void DbWriter::start(StorageBackend &storage, size_t capacity, const std::string &spool_dir, size_t spool_capacity)
+{
+	boost::system::error_code ec;
+	boost::filesystem::create_directories(spool_dir, ec);
+	if (ec)
+	{
+		std::cerr << "[DbWriter] Couldn't create spool directory \"" << spool_dir << "\": " << ec.message() << "\n";
+	}
+
+	// As many writers as the storage can take at the same time
+	size_t n_writers = std::max<size_t>(storage.getConcurrency(), 1);
+	for (size_t i = 0; i < n_writers; i++)
+	{
+		auto writer = std::make_unique<Writer>();
+		writer->capacity = std::max<size_t>((capacity + n_writers - 1) / n_writers, 1);
+		writer->spool = std::make_unique<DbSpool>((boost::filesystem::path(spool_dir) / ("writer" + std::to_string(i) + ".spool")).string());
+		writer->spooled = writer->spool->count();
+		writer->spool_capacity = std::max<size_t>((spool_capacity + n_writers - 1) / n_writers, 1);
+		writer->session = storage.createSession();
+		m_writers.push_back(std::move(writer));
+	}
+
+	redistributeSpools(spool_dir);
+
+	for (auto &writer : m_writers)
+	{
+		if (!writer->spool->empty())
+		{
+			uint64_t ignored = 0;
+			selectSpooled(SpooledStates(), loadSpool(*writer), writer->spool->count(), writer->spool_states, ignored);
+		}
+
+		Writer *w = writer.get();
+		w->thread = boost::thread([this, w]()
+		{
+			run(*w);
+		});
+	}
+}
+
+
+void DbWriter::redistributeSpools(const std::string &spool_dir)
+{
+	// Spools of writers that don't exist anymore (PoolSize went down) are handed to the writers
+	// of their agents, changes of one agent must stay in one spool to keep their order
+	for (size_t i = m_writers.size(); ; i++)
+	{
+		std::string path = (boost::filesystem::path(spool_dir) / ("writer" + std::to_string(i) + ".spool")).string();
+		if (!boost::filesystem::exists(path))
+		{
+			break;
+		}
+
+		DbSpool old(path);
+		std::vector<std::vector<json>> records(m_writers.size());
+		for (auto &record : old.load())
+		{
+			Event event;
+			if (decodeEvent(record, event))
+			{
+				records[writerIndex(event.agent)].push_back(std::move(record));
+			}
+		}
+
+		for (size_t w = 0; w < m_writers.size(); w++)
+		{
+			m_writers[w]->spool->append(records[w]);
+			m_writers[w]->spooled = m_writers[w]->spool->count();
+		}
+
+		old.replace(std::vector<json>());
+	}
+}
+
+
+void DbWriter::agentConnected(const std::string &agent, const std::string &ip, int status)
+{
+	Event event;
+	event.type = Event::AGENT_CONNECTED;
+	event.agent = agent;
+	event.ip = ip;
+	event.status = status;
+	push(std::move(event));
+}
+
+
+void DbWriter::agentStatus(const std::string &agent, int status)
+{
+	Event event;
+	event.type = Event::AGENT_STATUS;
+	event.agent = agent;
+	event.status = status;
+	push(std::move(event));
+}
+
+
+void DbWriter::agentProcesses(const std::string &agent, const json &processes, std::time_t observed_at)
+{
+	Event event;
+	event.type = Event::AGENT_PROCESSES;
+	event.agent = agent;
+	event.processes = processes;
+	event.observed_at = observed_at;
+	push(std::move(event));
+}
+
+
+size_t DbWriter::writerIndex(const std::string &agent) const
+{
+	return std::hash<std::string>()(agent) % m_writers.size();
+}
+
+
+void DbWriter::push(Event event)
+{
+	// Unless the caller knows when it was observed
+	if (!event.observed_at)
+	{
+		event.observed_at = std::time(nullptr);
+	}
+
+	event.queued_at = std::chrono::steady_clock::now();
+
+	// Events of one agent always go to the same writer, so they are written in order
+	Writer &writer = *m_writers[writerIndex(event.agent)];
+
+	{
+		std::lock_guard<std::mutex> lock(writer.mutex);
+
+		if (writer.queue.size() >= writer.capacity && event.type != Event::AGENT_CONNECTED)
+		{
+			writer.dropped++;
+			return;
+		}
+
+		writer.queue.push_back(std::move(event));
+	}
+
+	writer.not_empty.notify_one();
+}
+
+
+DbWriter::Stats DbWriter::getStats()
+{
+	Stats stats;
+	stats.queue_depth = 0;
+	stats.queue_capacity = 0;
+	stats.queue_lag = std::chrono::milliseconds(0);
+	stats.write_lag = std::chrono::milliseconds(0);
+	stats.written = 0;
+	stats.dropped = 0;
+	stats.failed = 0;
+	stats.spooled = 0;
+
+	auto now = std::chrono::steady_clock::now();
+
+	for (auto &writer : m_writers)
+	{
+		std::lock_guard<std::mutex> lock(writer->mutex);
+
+		stats.queue_depth += writer->queue.size();
+		stats.queue_capacity += writer->capacity;
+		if (!writer->queue.empty())
+		{
+			stats.queue_lag = std::max(stats.queue_lag, std::chrono::duration_cast<std::chrono::milliseconds>(now - writer->queue.front().queued_at));
+		}
+		stats.write_lag = std::max(stats.write_lag, writer->write_lag);
+		stats.written += writer->written;
+		stats.dropped += writer->dropped;
+		stats.failed += writer->failed;
+		stats.spooled += writer->spooled;
+	}
+
+	return stats;
+}
+
+
+void DbWriter::run(Writer &writer)
+{
+	while (true)
+	{
+		std::vector<Event> batch;
+		{
+			std::unique_lock<std::mutex> lock(writer.mutex);
+			writer.not_empty.wait(lock, [&writer]() { return !writer.queue.empty(); });
+
+			batch.assign(std::make_move_iterator(writer.queue.begin()), std::make_move_iterator(writer.queue.end()));
+			writer.queue.clear();
+		}
+
+		if (!writer.session->begin())
+		{
+			writer.session->end();
+			spoolEvents(writer, batch);
+			continue;
+		}
+
+		// Changes from the outage go first, in the order they were seen
+		bool replay = !writer.spool->empty();
+		if (replay)
+		{
+			std::vector<Event> spooled = loadSpool(writer);
+			std::cout << "[DbWriter] Writing " << spooled.size() << " change(s) saved while the storage was down\n";
+
+			spooled.insert(spooled.end(), std::make_move_iterator(batch.begin()), std::make_move_iterator(batch.end()));
+			batch = std::move(spooled);
+		}
+
+		std::vector<Event> unwritten;
+		writeBatch(writer, batch, unwritten);
+		writer.session->end();
+
+		// Connection was lost in the middle of the batch
+		if (replay || !unwritten.empty())
+		{
+			replaceSpool(writer, unwritten);
+		}
+	}
+}
+
+
+void DbWriter::writeBatch(Writer &writer, std::vector<Event> &batch, std::vector<Event> &unwritten)
+{
+	std::vector<const Event *> events;
+	for (const Event &event : batch)
+	{
+		events.push_back(&event);
+	}
+
+	// Commit once per TRANSACTION_SIZE events instead of once per statement
+	uint64_t written = 0, failed = 0;
+	for (size_t start = 0; start < events.size(); start += TRANSACTION_SIZE)
+	{
+		std::vector<const Event *> transaction(events.begin() + start, events.begin() + std::min(start + TRANSACTION_SIZE, events.size()));
+
+		uint64_t ok = 0;
+		StorageBackend::WriteResult result = unwritten.empty() ? writer.session->write(transaction, ok) : StorageBackend::WRITE_DISCONNECTED;
+		if (result == StorageBackend::WRITE_COMMITTED)
+		{
+			written += ok;
+			failed += transaction.size() - ok;
+		}
+		else if (result == StorageBackend::WRITE_FAILED)
+		{
+			failed += transaction.size();
+		}
+		else
+		{
+			// Database is gone, keep the rest for later
+			for (const Event *event : transaction)
+			{
+				unwritten.push_back(*event);
+			}
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(writer.mutex);
+	writer.write_lag = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - batch.front().queued_at);
+	writer.written += written;
+	writer.failed += failed;
+}
+
+
+json DbWriter::encodeEvent(const Event &event)
+{
+	json record;
+	record["type"] = static_cast<int>(event.type);
+	record["agent"] = event.agent;
+	record["time"] = event.observed_at;
+
+	switch (event.type)
+	{
+	case Event::AGENT_CONNECTED:
+		record["ip"] = event.ip;
+		record["status"] = event.status;
+		break;
+
+	case Event::AGENT_STATUS:
+		record["status"] = event.status;
+		break;
+
+	case Event::AGENT_PROCESSES:
+		record["processes"] = event.processes;
+		break;
+	}
+
+	return record;
+}
+
+
+bool DbWriter::decodeEvent(const json &record, Event &event)
+{
+	try
+	{
+		int type = record.at("type").get<int>();
+		if (type < Event::AGENT_CONNECTED || type > Event::AGENT_PROCESSES)
+		{
+			return false;
+		}
+
+		event.type = static_cast<Event::Type>(type);
+		event.agent = record.at("agent").get<std::string>();
+		// Spools written before the time was recorded
+		event.observed_at = record.count("time") ? record["time"].get<std::time_t>() : std::time(nullptr);
+
+		if (event.type == Event::AGENT_CONNECTED)
+		{
+			event.ip = record.at("ip").get<std::string>();
+		}
+
+		if (event.type != Event::AGENT_PROCESSES)
+		{
+			event.status = record.at("status").get<int>();
+		}
+		else
+		{
+			event.processes = record.at("processes");
+		}
+	}
+	catch (json::exception &)
+	{
+		return false;
+	}
+
+	// Age in the spool isn't known, the lag counts from the replay
+	event.queued_at = std::chrono::steady_clock::now();
+	return true;
+}
+
+
+std::vector<DbWriter::Event> DbWriter::loadSpool(Writer &writer)
+{
+	std::vector<Event> events;
+
+	for (const auto &record : writer.spool->load())
+	{
+		Event event;
+		if (decodeEvent(record, event))
+		{
+			events.push_back(std::move(event));
+		}
+	}
+
+	return events;
+}
+
+
+void DbWriter::replaceSpool(Writer &writer, const std::vector<Event> &events)
+{
+	// Same limits as spoolEvents, the new spool starts empty
+	SpooledStates changed;
+	uint64_t dropped = 0;
+	std::vector<json> records = selectSpooled(SpooledStates(), events, writer.spool_capacity, changed, dropped);
+
+	// If the spool can't be replaced the old one stays, with the state it had
+	if (writer.spool->replace(records))
+	{
+		writer.spool_states = std::move(changed);
+	}
+
+	std::lock_guard<std::mutex> lock(writer.mutex);
+	writer.spooled = writer.spool->count();
+	writer.dropped += dropped;
+}
+
+
+void DbWriter::spoolEvents(Writer &writer, std::vector<Event> &events)
+{
+	// Every change is kept, the process history of the outage is written from them. Polls that
+	// found nothing new are left out, without them the spool grows with the changes only.
+	size_t room = writer.spool_capacity > writer.spool->count() ? writer.spool_capacity - writer.spool->count() : 0;
+
+	SpooledStates changed;
+	uint64_t dropped = 0;
+	std::vector<json> records = selectSpooled(writer.spool_states, events, room, changed, dropped);
+
+	// Changes that didn't make it to the disk are lost, the spool state stays as it was
+	if (writer.spool->append(records))
+	{
+		for (auto &el : changed)
+		{
+			writer.spool_states[el.first] = std::move(el.second);
+		}
+	}
+	else
+	{
+		dropped += records.size();
+	}
+
+	std::lock_guard<std::mutex> lock(writer.mutex);
+	writer.spooled = writer.spool->count();
+	writer.dropped += dropped;
+}
+
+
+std::vector<json> DbWriter::selectSpooled(const SpooledStates &spooled, const std::vector<Event> &events, size_t room, SpooledStates &changed, uint64_t &dropped)
+{
+	std::vector<json> records;
+
+	for (const Event &event : events)
+	{
+		auto find = changed.find(event.agent);
+		if (find == changed.end())
+		{
+			auto base = spooled.find(event.agent);
+			find = changed.emplace(event.agent, base != spooled.end() ? base->second : SpooledState()).first;
+		}
+
+		SpooledState &state = find->second;
+
+		if (event.type == Event::AGENT_STATUS && state.has_status && state.status == event.status)
+		{
+			continue;
+		}
+
+		if (event.type == Event::AGENT_PROCESSES && state.has_processes && state.processes == event.processes)
+		{
+			continue;
+		}
+
+		if (records.size() >= room)
+		{
+			dropped++;
+			continue;
+		}
+
+		if (event.type == Event::AGENT_PROCESSES)
+		{
+			state.has_processes = true;
+			state.processes = event.processes;
+		}
+		else
+		{
+			// The storage closes out the processes of an agent that stopped, the same list after
+			// a status change isn't a repeat
+			state.has_status = true;
+			state.status = event.status;
+			state.has_processes = false;
+			state.processes = json();
+		}
+
+		records.push_back(encodeEvent(event));
+	}
+
+	return records;
+}
+
+
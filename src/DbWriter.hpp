@@ -0,0 +1,124 @@
+#pragma once
+
+#include <boost/thread.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "DbSpool.hpp"
+#include "StorageBackend.hpp"
+
+
+using json = nlohmann::json;
+
+
+// Writes agent state changes to the storage on its own threads
+//
+// Agent polling only queues events here and never waits for the storage. There is one writer
+// thread per storage session, events of an agent always go to the same writer. A writer takes
+// everything that is queued at once and writes it as one batch. Every event is written in
+// order, the storage keeps only the newest state but records every process transition.
+class DbWriter
+{
+public:
+	using Event = StorageEvent;
+
+	// Changes written by a single StorageBackend::Session::write
+	static const size_t TRANSACTION_SIZE{ 200 };
+
+	struct Stats
+	{
+		size_t queue_depth;
+		size_t queue_capacity;
+		// Age of the oldest event waiting in the queue
+		std::chrono::milliseconds queue_lag;
+		// Time between queuing and writing of the oldest event in the last batch
+		std::chrono::milliseconds write_lag;
+		uint64_t written;
+		// Changes lost to a full queue or a full spool
+		uint64_t dropped;
+		uint64_t failed;
+		// Changes saved to the spool while the storage is down
+		uint64_t spooled;
+	};
+
+private:
+	// Last status and processes of an agent in the spool, repeats of them aren't spooled
+	struct SpooledState
+	{
+		bool has_status{ false };
+		int status{ 0 };
+		bool has_processes{ false };
+		json processes;
+	};
+
+	using SpooledStates = std::map<std::string, SpooledState>;
+
+	// Writer thread with its own queue, every agent is handled by one of them
+	struct Writer
+	{
+		boost::thread thread;
+
+		std::mutex mutex;
+		std::condition_variable not_empty;
+		std::deque<Event> queue;
+		size_t capacity{ 0 };
+
+		// Guarded by mutex
+		std::chrono::milliseconds write_lag{ 0 };
+		uint64_t written{ 0 };
+		uint64_t dropped{ 0 };
+		uint64_t failed{ 0 };
+		size_t spooled{ 0 };
+
+		// Everything below is only touched from the writer's thread
+
+		std::unique_ptr<StorageBackend::Session> session;
+		// Changes that couldn't be written because the storage was down
+		std::unique_ptr<DbSpool> spool;
+		size_t spool_capacity{ 0 };
+		// State of every agent in the spool, as of the last record that was written to it
+		SpooledStates spool_states;
+	};
+
+	std::vector<std::unique_ptr<Writer>> m_writers;
+
+	static json encodeEvent(const Event &event);
+	static bool decodeEvent(const json &record, Event &event);
+	std::vector<Event> loadSpool(Writer &writer);
+	void replaceSpool(Writer &writer, const std::vector<Event> &events);
+	void spoolEvents(Writer &writer, std::vector<Event> &events);
+	// Picks the events that don't repeat the spooled state of their agent, at most room of them.
+	// The states they leave are put in changed, the events beyond room are counted in dropped.
+	static std::vector<json> selectSpooled(const SpooledStates &spooled, const std::vector<Event> &events, size_t room, SpooledStates &changed, uint64_t &dropped);
+	void redistributeSpools(const std::string &spool_dir);
+
+	size_t writerIndex(const std::string &agent) const;
+	void push(Event event);
+	void run(Writer &writer);
+	// Events that weren't written because the connection was lost are put in unwritten
+	void writeBatch(Writer &writer, std::vector<Event> &batch, std::vector<Event> &unwritten);
+
+public:
+	DbWriter();
+
+	// Changes that can't be written while the storage is down are saved in spool_dir
+	// and written once it's back, also after a restart. At most spool_capacity of them are kept.
+	void start(StorageBackend &storage, size_t capacity, const std::string &spool_dir, size_t spool_capacity);
+
+	// Status and process events are dropped when the queue is full, the next poll
+	// of the agent reports its state again. Connected events are always queued.
+	void agentConnected(const std::string &agent, const std::string &ip, int status);
+	void agentStatus(const std::string &agent, int status);
+	// observed_at is when the processes were received, 0 = now
+	void agentProcesses(const std::string &agent, const json &processes, std::time_t observed_at = 0);
+
+	Stats getStats();
+};
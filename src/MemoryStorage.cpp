@@ -0,0 +1,215 @@
+#include <algorithm>
+#include <iostream>
+
+#include "MemoryStorage.hpp"
+
+
+const std::time_t MemoryStorage::HOURLY_RETENTION;
+
+
+bool MemoryStorage::connect(const Configuration &)
+{
+	std::cout << "[MemoryStorage] Keeping agent states in memory, they are lost on exit\n";
+
+	// There is no history from before the start
+	m_rolled_up_to = ProcessHistory::hourStart(std::time(nullptr));
+	return true;
+}
+
+
+std::unique_ptr<StorageBackend::Session> MemoryStorage::createSession()
+{
+	return std::make_unique<Session>(*this);
+}
+
+
+StorageBackend::WriteResult MemoryStorage::Session::write(const std::vector<const StorageEvent *> &events, uint64_t &written)
+{
+	std::lock_guard<std::mutex> lock(m_storage.m_mutex);
+
+	written = 0;
+	for (const StorageEvent *event : events)
+	{
+		bool ok = false;
+
+		switch (event->type)
+		{
+		case StorageEvent::AGENT_CONNECTED:
+			m_storage.addAgent(event->agent, event->ip, event->status);
+			ok = true;
+			break;
+
+		case StorageEvent::AGENT_STATUS:
+			ok = m_storage.updateAgentStatus(event->agent, event->status, event->observed_at);
+			break;
+
+		case StorageEvent::AGENT_PROCESSES:
+			ok = m_storage.updateAgentProcesses(event->agent, event->processes, event->observed_at);
+			break;
+		}
+
+		if (ok)
+		{
+			written++;
+		}
+	}
+
+	return WRITE_COMMITTED;
+}
+
+
+void MemoryStorage::addAgent(const std::string &agent, const std::string &ip, int status)
+{
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end())
+	{
+		Agent &added = m_agents[agent];
+		added.id = m_next_id++;
+		added.ip = ip;
+		added.status = status;
+		added.last_updated = std::chrono::system_clock::now();
+	}
+	else
+	{
+		find->second.ip = ip;
+		find->second.status = status;
+		find->second.last_updated = std::chrono::system_clock::now();
+	}
+}
+
+
+bool MemoryStorage::updateAgentStatus(const std::string &agent, int status, std::time_t observed_at)
+{
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end())
+	{
+		return false;
+	}
+
+	Agent &entry = find->second;
+	entry.status = status;
+	entry.last_updated = std::chrono::system_clock::now();
+
+	// Nothing is known about the processes of an agent that doesn't answer
+	if (status != StorageEvent::STATUS_RUNNING && entry.processes_known)
+	{
+		std::time_t at = std::max(observed_at, m_rolled_up_to);
+		for (auto &el : entry.processes)
+		{
+			if (el.second.monitored)
+			{
+				el.second.history.push_back({ at, ProcessHistory::STATE_UNMONITORED });
+			}
+		}
+
+		entry.processes_known = false;
+	}
+
+	return true;
+}
+
+
+bool MemoryStorage::updateAgentProcesses(const std::string &agent, const json &processes, std::time_t observed_at)
+{
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end())
+	{
+		return false;
+	}
+
+	// Changes seen before the last rollup count from the first hour that's still open
+	std::time_t at = std::max(observed_at, m_rolled_up_to);
+
+	// Same as in the processes table: processes the agent doesn't report stay, but aren't monitored
+	for (auto &el : find->second.processes)
+	{
+		if (el.second.monitored && !processes.count(el.first))
+		{
+			el.second.monitored = false;
+			el.second.history.push_back({ at, ProcessHistory::STATE_UNMONITORED });
+		}
+	}
+
+	for (const auto &el : processes.items())
+	{
+		bool known = find->second.processes.count(el.key()) != 0;
+		Process &process = find->second.processes[el.key()];
+		int status = el.value();
+
+		if (!known || !process.monitored || process.status != status || !find->second.processes_known)
+		{
+			process.history.push_back({ at, status });
+		}
+
+		process.monitored = true;
+		process.status = status;
+	}
+
+	find->second.processes_known = true;
+	return true;
+}
+
+
+void MemoryStorage::rollup(std::time_t now)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	std::time_t end = ProcessHistory::hourStart(now - ProcessHistory::ROLLUP_DELAY);
+	if (m_rolled_up_to >= end)
+	{
+		return;
+	}
+
+	for (auto &agent : m_agents)
+	{
+		for (auto &el : agent.second.processes)
+		{
+			Process &process = el.second;
+
+			for (std::time_t start = m_rolled_up_to; start < end; start += ProcessHistory::HOUR)
+			{
+				rollupHour(process, start);
+			}
+
+			// Rolled up transitions aren't needed anymore, rolled_up_state carries their result
+			process.history.erase(std::remove_if(process.history.begin(), process.history.end(), [end](const ProcessHistory::Transition &transition)
+			{
+				return transition.at < end;
+			}), process.history.end());
+
+			process.hourly.erase(process.hourly.begin(), process.hourly.lower_bound(end - HOURLY_RETENTION));
+		}
+	}
+
+	m_rolled_up_to = end;
+}
+
+
+void MemoryStorage::rollupHour(Process &process, std::time_t start)
+{
+	ProcessHistory::Uptime hour = ProcessHistory::summarize(process.rolled_up_state, process.history, start, start + ProcessHistory::HOUR);
+
+	// Hours the process wasn't monitored in at all are left out
+	if (hour.monitored || hour.transitions)
+	{
+		process.hourly[start] = hour;
+	}
+
+	// Last hour of a day, the day is the sum of its hours
+	std::time_t end = start + ProcessHistory::HOUR;
+	if (end % ProcessHistory::DAY == 0)
+	{
+		std::time_t day_start = end - ProcessHistory::DAY;
+
+		ProcessHistory::Uptime day;
+		for (auto it = process.hourly.lower_bound(day_start); it != process.hourly.end() && it->first < end; ++it)
+		{
+			day.add(it->second);
+		}
+
+		if (day.monitored || day.transitions)
+		{
+			process.daily[day_start] = day;
+		}
+	}
+}
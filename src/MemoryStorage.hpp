@@ -0,0 +1,79 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ProcessHistory.hpp"
+#include "StorageBackend.hpp"
+
+
+// Agent states kept in the monitor's memory only, for running without a database and for
+// load testing the polling without paying database latency. Nothing survives a restart.
+class MemoryStorage : public StorageBackend
+{
+public:
+	// Hourly uptime older than this is dropped, daily uptime is kept
+	static const std::time_t HOURLY_RETENTION{ 7 * ProcessHistory::DAY };
+
+	struct Process
+	{
+		bool monitored{ true };
+		int status{ 0 };
+
+		// Transitions that aren't rolled up yet
+		std::vector<ProcessHistory::Transition> history;
+		// State at the end of the last rolled up hour
+		int rolled_up_state{ ProcessHistory::STATE_UNMONITORED };
+		// Uptime by start of the period
+		std::map<std::time_t, ProcessHistory::Uptime> hourly;
+		std::map<std::time_t, ProcessHistory::Uptime> daily;
+	};
+
+	struct Agent
+	{
+		int id{ 0 };
+		std::string ip;
+		int status{ 0 };
+		std::chrono::system_clock::time_point last_updated;
+		std::map<std::string, Process> processes;
+		// False since the agent went down, its processes are unmonitored in the history until its next process list
+		bool processes_known{ true };
+	};
+
+private:
+	class Session : public StorageBackend::Session
+	{
+	private:
+		MemoryStorage &m_storage;
+
+	public:
+		Session(MemoryStorage &storage) : m_storage{ storage } {}
+
+		bool begin() override { return true; }
+		void end() override {}
+		WriteResult write(const std::vector<const StorageEvent *> &events, uint64_t &written) override;
+	};
+
+	std::mutex m_mutex;
+	std::map<std::string, Agent> m_agents;
+	int m_next_id{ 1 };
+	// Start of the first hour that isn't rolled up yet
+	std::time_t m_rolled_up_to{ 0 };
+
+	// These expect m_mutex to be locked
+	void addAgent(const std::string &agent, const std::string &ip, int status);
+	bool updateAgentStatus(const std::string &agent, int status, std::time_t observed_at);
+	bool updateAgentProcesses(const std::string &agent, const json &processes, std::time_t observed_at);
+	void rollupHour(Process &process, std::time_t start);
+
+public:
+	bool connect(const Configuration &config) override;
+
+	// Writes are applied under a single lock, more sessions wouldn't help
+	size_t getConcurrency() const override { return 1; }
+	std::unique_ptr<StorageBackend::Session> createSession() override;
+	void rollup(std::time_t now) override;
+};
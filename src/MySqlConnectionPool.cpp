@@ -0,0 +1,114 @@
+#include <algorithm>
+#include <iostream>
+
+#include "MySqlConnectionPool.hpp"
+
+
+MySqlConnectionPool::Connection::~Connection()
+{
+	if (m_pool)
+	{
+		m_pool->release(m_index);
+	}
+}
+
+
+bool MySqlConnectionPool::connect(const Configuration &config, size_t size)
+{
+	std::vector<Slot> slots(std::max<size_t>(size, 1));
+
+	for (auto &slot : slots)
+	{
+		slot.db = std::make_unique<MySqlJdbcConnector>();
+		if (!slot.db->connect(config))
+		{
+			return false;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_slots = std::move(slots);
+	return true;
+}
+
+
+MySqlConnectionPool::Connection MySqlConnectionPool::acquire()
+{
+	std::thread::id self = std::this_thread::get_id();
+	size_t index = 0;
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		m_available.wait(lock, [&]()
+		{
+			// Prefer the connection this thread used last, then one nobody used yet, then any free one
+			bool found = false;
+			for (size_t i = 0; i < m_slots.size(); i++)
+			{
+				if (m_slots[i].in_use)
+				{
+					continue;
+				}
+
+				if (m_slots[i].last_user == self)
+				{
+					index = i;
+					return true;
+				}
+
+				if (!found || m_slots[i].last_user == std::thread::id())
+				{
+					index = i;
+					found = true;
+				}
+			}
+
+			return found;
+		});
+
+		m_slots[index].in_use = true;
+		m_slots[index].last_user = self;
+	}
+
+	Connection conn(this, index);
+	Slot &slot = m_slots[index];
+
+	try
+	{
+		bool was_connected = slot.connected;
+		slot.connected = conn->tryReconnect();
+
+		if (!slot.connected && was_connected)
+		{
+			std::cerr << "[MySqlConnectionPool] Lost connection to Mysql database\n";
+		}
+		else if (slot.connected && !was_connected)
+		{
+			std::cout << "[MySqlConnectionPool] Reconnected to Mysql database\n";
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		// The next acquire tries again
+		if (slot.connected)
+		{
+			std::cerr << "[MySqlConnectionPool] Failed to reconnect: " << e.what() << "\n";
+		}
+
+		slot.connected = false;
+	}
+
+	return conn;
+}
+
+
+void MySqlConnectionPool::release(size_t index)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_slots[index].in_use = false;
+	}
+
+	m_available.notify_all();
+}
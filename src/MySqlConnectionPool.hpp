@@ -0,0 +1,67 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Configuration.hpp"
+#include "MySqlJdbcConnector.hpp"
+
+
+// Fixed number of database connections shared by threads that write to the database
+//
+// A thread checks a connection out with acquire() and gets it back to the pool when the returned
+// handle goes out of scope. Every connection is used by one thread at a time, a thread gets the
+// connection it used last when it's free, so its prepared statements stay warm.
+class MySqlConnectionPool
+{
+public:
+	// Checked out connection, returned to the pool on destruction
+	class Connection
+	{
+	private:
+		MySqlConnectionPool *m_pool;
+		size_t m_index;
+
+	public:
+		Connection(MySqlConnectionPool *pool, size_t index) : m_pool{ pool }, m_index{ index } {}
+		Connection(Connection &&other) : m_pool{ other.m_pool }, m_index{ other.m_index } { other.m_pool = nullptr; }
+		Connection(const Connection &) = delete;
+		Connection &operator=(const Connection &) = delete;
+		~Connection();
+
+		MySqlJdbcConnector &operator*() const { return *m_pool->m_slots[m_index].db; }
+		MySqlJdbcConnector *operator->() const { return m_pool->m_slots[m_index].db.get(); }
+
+		// False if the database couldn't be reached when the connection was checked out
+		bool isConnected() const { return m_pool->m_slots[m_index].connected; }
+	};
+
+private:
+	struct Slot
+	{
+		std::unique_ptr<MySqlJdbcConnector> db;
+		bool in_use{ false };
+		// Only touched by the thread that has the connection checked out
+		bool connected{ true };
+		// Thread that had the connection checked out last
+		std::thread::id last_user;
+	};
+
+	std::mutex m_mutex;
+	std::condition_variable m_available;
+	std::vector<Slot> m_slots;
+
+	void release(size_t index);
+
+public:
+	// Opens size connections, fails if any of them can't be opened
+	bool connect(const Configuration &config, size_t size);
+
+	// Blocks until a connection is free. The connection is checked and reconnected if it was lost.
+	Connection acquire();
+
+	size_t size() const { return m_slots.size(); }
+};
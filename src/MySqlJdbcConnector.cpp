@@ -15,6 +15,7 @@ bool MySqlJdbcConnector::connect(const Configuration &config)
 {
 	try
 	{
+		m_statements.clear();
 		m_connection = std::unique_ptr<sql::Connection>(m_driver->connect(config.getDbUrl(), config.getDbUser(), config.getDbPassword()));
 		m_connection->setSchema(config.getDbName());
 		return true;
@@ -33,6 +34,8 @@ bool MySqlJdbcConnector::tryReconnect()
 {
 	if (!m_connection->isValid())
 	{
+		// Statements prepared on the old connection are gone on the server
+		m_statements.clear();
 		return m_connection->reconnect();
 	}
 
@@ -46,9 +49,42 @@ std::unique_ptr<sql::Statement> MySqlJdbcConnector::createStatement()
 }
 
 
+void MySqlJdbcConnector::beginTransaction()
+{
+	m_connection->setAutoCommit(false);
+}
+
+
+void MySqlJdbcConnector::commit()
+{
+	m_connection->commit();
+	m_connection->setAutoCommit(true);
+}
+
+
+void MySqlJdbcConnector::rollback()
+{
+	m_connection->rollback();
+	m_connection->setAutoCommit(true);
+}
+
+
 std::unique_ptr<sql::PreparedStatement> MySqlJdbcConnector::prepareStatement(const std::string &statement)
 {
 	return std::unique_ptr<sql::PreparedStatement>(m_connection->prepareStatement(statement));
 }
 
 
+sql::PreparedStatement *MySqlJdbcConnector::cachedStatement(const std::string &statement)
+{
+	auto find = m_statements.find(statement);
+	if (find != m_statements.end())
+	{
+		find->second->clearParameters();
+		return find->second.get();
+	}
+
+	sql::PreparedStatement *stat = m_connection->prepareStatement(statement);
+	m_statements[statement] = std::unique_ptr<sql::PreparedStatement>(stat);
+	return stat;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -22,6 +23,9 @@ private:
 	sql::Driver *m_driver;
 	std::unique_ptr<sql::Connection> m_connection;
 
+	// Statements prepared on m_connection by their SQL, dropped when the connection is replaced
+	std::map<std::string, std::unique_ptr<sql::PreparedStatement>> m_statements;
+
 public:
 	MySqlJdbcConnector();
 
@@ -30,7 +34,17 @@ public:
 
 	std::unique_ptr<sql::Statement> createStatement();
 
+	// Statements executed until commit or rollback form a single transaction
+	void beginTransaction();
+	void commit();
+	void rollback();
+
 	// Executing a prepared statement takes less time than Statement because it 
 	// parses,compiles the query + optimizes things in the constructor
 	std::unique_ptr<sql::PreparedStatement> prepareStatement(const std::string &statement);
+
+	// Same as prepareStatement, but each statement is prepared only once per connection.
+	// The statement is owned by the connector and its parameters are cleared, it stays valid
+	// until the next call to connect or tryReconnect.
+	sql::PreparedStatement *cachedStatement(const std::string &statement);
 };
\ No newline at end of file
@@ -0,0 +1,265 @@
+#include <iostream>
+#include <vector>
+
+#include "MySqlSchema.hpp"
+
+
+const int MySqlSchema::VERSION;
+const int MySqlSchema::LOCK_TIMEOUT;
+
+
+namespace
+{
+	const int ERROR_DUPLICATE_ENTRY = 1062;
+
+	struct Migration
+	{
+		int version;
+		const char *description;
+		std::vector<const char *> statements;
+	};
+
+	const Migration MIGRATIONS[] = {
+		{ 1, "agents and processes tables", {
+			"CREATE TABLE IF NOT EXISTS agents ("
+			"id INT NOT NULL AUTO_INCREMENT, "
+			"name VARCHAR(255) NOT NULL, "
+			"ip VARCHAR(45) NOT NULL DEFAULT '', "
+			"status INT NOT NULL DEFAULT 0, "
+			"last_updated TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+			"PRIMARY KEY (id)) ENGINE=InnoDB",
+
+			"CREATE TABLE IF NOT EXISTS processes ("
+			"id INT NOT NULL AUTO_INCREMENT, "
+			"agent_id INT NOT NULL, "
+			"name VARCHAR(255) NOT NULL, "
+			"monitored TINYINT NOT NULL DEFAULT 1, "
+			"status INT NOT NULL DEFAULT 0, "
+			"PRIMARY KEY (id)) ENGINE=InnoDB"
+		} },
+
+		// Indexes only, see INDEXES
+		{ 2, "unique agent and process names, status indexes", {} },
+
+		{ 3, "process history and uptime rollups", {
+			"CREATE TABLE IF NOT EXISTS process_history ("
+			"process_id INT NOT NULL, "
+			"changed_at INT UNSIGNED NOT NULL, "
+			"state TINYINT NOT NULL, "
+			"PRIMARY KEY (process_id, changed_at)) ENGINE=InnoDB",
+
+			"CREATE TABLE IF NOT EXISTS process_uptime ("
+			"process_id INT NOT NULL, "
+			"period ENUM('hour', 'day') NOT NULL, "
+			"period_start INT UNSIGNED NOT NULL, "
+			"running_seconds INT UNSIGNED NOT NULL, "
+			"monitored_seconds INT UNSIGNED NOT NULL, "
+			"transitions INT UNSIGNED NOT NULL, "
+			"PRIMARY KEY (process_id, period, period_start)) ENGINE=InnoDB"
+		} }
+	};
+
+	struct Index
+	{
+		// Migration that adds the index
+		int version;
+		const char *table;
+		// PRIMARY for the primary key
+		const char *name;
+		const char *columns;
+		bool unique;
+	};
+
+	// Every index the queries rely on, they are checked on every start
+	const Index INDEXES[] = {
+		// Agent id lookup by name, inserts of new agents
+		{ 2, "agents", "agent_name", "name", true },
+		{ 2, "agents", "agent_status", "status", false },
+		// Process upserts and the process sync of an agent
+		{ 2, "processes", "agent_process", "agent_id,name", true },
+		{ 2, "processes", "process_status", "monitored,status", false },
+		{ 3, "process_history", "PRIMARY", "process_id,changed_at", true },
+		// Transitions of an hour being rolled up
+		{ 3, "process_history", "changed_at", "changed_at", false },
+		{ 3, "process_uptime", "PRIMARY", "process_id,period,period_start", true },
+		{ 3, "process_uptime", "period", "period,period_start", false }
+	};
+}
+
+
+bool MySqlSchema::migrate(MySqlJdbcConnector &db)
+{
+	std::unique_ptr<sql::Statement> stat;
+
+	try
+	{
+		stat = db.createStatement();
+
+		// Monitors started at the same time don't migrate over each other
+		std::unique_ptr<sql::ResultSet> res(stat->executeQuery("SELECT GET_LOCK('monitor_schema', " + std::to_string(LOCK_TIMEOUT) + ") AS locked"));
+		if (!res->first() || res->getInt("locked") != 1)
+		{
+			std::cerr << "[MySqlSchema] Timed out waiting for another monitor to migrate the database\n";
+			return false;
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		std::cerr << "[MySqlSchema] Failed to lock the schema: " << e.what() << "\n";
+		return false;
+	}
+
+	bool ok = true;
+	int version = 0;
+
+	try
+	{
+		stat->execute("CREATE TABLE IF NOT EXISTS schema_version ("
+			"version INT NOT NULL, "
+			"description VARCHAR(255) NOT NULL, "
+			"applied_at TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP, "
+			"PRIMARY KEY (version)) ENGINE=InnoDB");
+
+		int current = currentVersion(db);
+		if (current > VERSION)
+		{
+			std::cerr << "[MySqlSchema] Database schema version " << current << " is newer than this monitor supports (" << VERSION << ")\n";
+			ok = false;
+		}
+
+		for (const Migration &migration : MIGRATIONS)
+		{
+			if (ok && migration.version > current)
+			{
+				version = migration.version;
+				std::cout << "[MySqlSchema] Applying migration " << migration.version << ": " << migration.description << "\n";
+				apply(db, migration.version);
+			}
+		}
+
+		if (ok)
+		{
+			std::string missing = missingIndexes(db);
+			if (!missing.empty())
+			{
+				std::cerr << "[MySqlSchema] Missing indexes: " << missing << "\n";
+				ok = false;
+			}
+			else if (current != VERSION)
+			{
+				std::cout << "[MySqlSchema] Database schema is at version " << VERSION << "\n";
+			}
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		std::cerr << "[MySqlSchema] Migration " << version << " failed: " << e.what() << "\n";
+		if (e.getErrorCode() == ERROR_DUPLICATE_ENTRY)
+		{
+			std::cerr << "[MySqlSchema] Remove the duplicate rows and start again\n";
+		}
+
+		ok = false;
+	}
+
+	try
+	{
+		stat->execute("DO RELEASE_LOCK('monitor_schema')");
+	}
+	catch (sql::SQLException &)
+	{
+		// Released with the connection
+	}
+
+	return ok;
+}
+
+
+int MySqlSchema::currentVersion(MySqlJdbcConnector &db)
+{
+	auto stat = db.createStatement();
+
+	std::unique_ptr<sql::ResultSet> res(stat->executeQuery("SELECT MAX(version) AS version FROM schema_version"));
+	if (!res->first() || res->isNull("version"))
+	{
+		return 0;
+	}
+
+	return res->getInt("version");
+}
+
+
+void MySqlSchema::apply(MySqlJdbcConnector &db, int version)
+{
+	auto stat = db.createStatement();
+
+	// DDL can't be rolled back, every step checks what is there already
+	for (const Migration &migration : MIGRATIONS)
+	{
+		if (migration.version != version)
+		{
+			continue;
+		}
+
+		for (const char *sql : migration.statements)
+		{
+			stat->execute(sql);
+		}
+
+		for (const Index &index : INDEXES)
+		{
+			if (index.version != version || hasIndex(db, index.table, index.columns, index.unique))
+			{
+				continue;
+			}
+
+			std::string key = std::string(index.name) == "PRIMARY" ? "PRIMARY KEY" : std::string(index.unique ? "UNIQUE KEY " : "KEY ") + index.name;
+			stat->execute(std::string("ALTER TABLE ") + index.table + " ADD " + key + " (" + index.columns + ")");
+		}
+
+		sql::PreparedStatement *insert = db.cachedStatement("INSERT INTO schema_version (version, description) VALUES (?, ?)");
+		insert->setInt(1, migration.version);
+		insert->setString(2, migration.description);
+		insert->execute();
+	}
+}
+
+
+bool MySqlSchema::hasIndex(MySqlJdbcConnector &db, const std::string &table, const std::string &columns, bool unique)
+{
+	sql::PreparedStatement *select = db.cachedStatement("SELECT non_unique AS is_non_unique, GROUP_CONCAT(column_name ORDER BY seq_in_index) AS index_columns "
+		"FROM information_schema.statistics WHERE table_schema = DATABASE() AND table_name = ? GROUP BY index_name, non_unique");
+	select->setString(1, table);
+
+	std::unique_ptr<sql::ResultSet> res(select->executeQuery());
+	while (res->next())
+	{
+		if (res->getString("index_columns") == columns && (!unique || res->getInt("is_non_unique") == 0))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+std::string MySqlSchema::missingIndexes(MySqlJdbcConnector &db)
+{
+	std::string missing;
+
+	for (const Index &index : INDEXES)
+	{
+		if (!hasIndex(db, index.table, index.columns, index.unique))
+		{
+			if (!missing.empty())
+			{
+				missing += ", ";
+			}
+
+			missing += std::string(index.table) + "." + index.name + " (" + index.columns + ")";
+		}
+	}
+
+	return missing;
+}
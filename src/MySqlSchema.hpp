@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+
+#include "MySqlJdbcConnector.hpp"
+
+
+// Tables and indexes the monitor needs in its Mysql database
+//
+// The schema is versioned in the schema_version table. Migrations that the database doesn't have
+// yet are applied in order on startup, then every index the queries rely on is checked. Each
+// migration can be repeated safely, a migration interrupted halfway is finished on the next start.
+class MySqlSchema
+{
+public:
+	// Version of the newest migration in MySqlSchema.cpp
+	static const int VERSION{ 3 };
+
+	// Returns false if the schema couldn't be brought up to date or an index is missing
+	static bool migrate(MySqlJdbcConnector &db);
+
+private:
+	// Other monitors wait for a migration in progress up to this many seconds
+	static const int LOCK_TIMEOUT{ 60 };
+
+	static int currentVersion(MySqlJdbcConnector &db);
+	static void apply(MySqlJdbcConnector &db, int version);
+
+	// Index with exactly these columns (comma separated, in order) exists. A unique index
+	// is only satisfied by a unique one, primary keys count too.
+	static bool hasIndex(MySqlJdbcConnector &db, const std::string &table, const std::string &columns, bool unique);
+	// Returns the names of the required indexes that don't exist
+	static std::string missingIndexes(MySqlJdbcConnector &db);
+};
@@ -0,0 +1,812 @@
+#include <algorithm>
+#include <iostream>
+
+#include "MySqlSchema.hpp"
+#include "MySqlStorage.hpp"
+
+
+const size_t MySqlStorage::BATCH_SIZE;
+
+
+bool MySqlStorage::connect(const Configuration &config)
+{
+	if (!m_pool.connect(config, config.getDbPoolSize()))
+	{
+		return false;
+	}
+
+	std::cout << "[MySqlStorage] Connected to Mysql database (" << m_pool.size() << " connection(s))\n";
+
+	// Upserts and id lookups rely on the unique keys
+	{
+		MySqlConnectionPool::Connection db = m_pool.acquire();
+		if (!MySqlSchema::migrate(*db))
+		{
+			return false;
+		}
+	}
+
+	loadAgentIds();
+	return true;
+}
+
+
+std::unique_ptr<StorageBackend::Session> MySqlStorage::createSession()
+{
+	return std::make_unique<Session>(*this);
+}
+
+
+bool MySqlStorage::isConnectionError(const sql::SQLException &e)
+{
+	switch (e.getErrorCode())
+	{
+	case ERROR_CONNECTION:
+	case ERROR_CONN_HOST:
+	case ERROR_SERVER_GONE:
+	case ERROR_SERVER_LOST:
+	case ERROR_SERVER_LOST_EXTENDED:
+		return true;
+	}
+
+	return false;
+}
+
+
+bool MySqlStorage::abortsTransaction(const sql::SQLException &e)
+{
+	return e.getErrorCode() == ERROR_LOCK_DEADLOCK || e.getErrorCode() == ERROR_LOCK_WAIT_TIMEOUT || isConnectionError(e);
+}
+
+
+std::string MySqlStorage::placeholders(const std::string &group, size_t count, const std::string &separator)
+{
+	std::string list;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (i)
+		{
+			list += separator;
+		}
+
+		list += group;
+	}
+
+	return list;
+}
+
+
+size_t MySqlStorage::statementRows(size_t count)
+{
+	size_t rows = 1;
+	while (rows < count)
+	{
+		rows *= 4;
+	}
+
+	return std::min(rows, BATCH_SIZE);
+}
+
+
+void MySqlStorage::loadAgentIds()
+{
+	try
+	{
+		MySqlConnectionPool::Connection db = m_pool.acquire();
+
+		auto stat = db->createStatement();
+		std::unique_ptr<sql::ResultSet> res(stat->executeQuery("SELECT id, name FROM agents"));
+		while (res->next())
+		{
+			std::lock_guard<std::mutex> lock(m_ids_mutex);
+			m_agent_ids[res->getString("name")] = res->getInt("id");
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		// Ids are looked up on first use instead
+		std::cerr << "[MySqlStorage] Failed to load agent ids: " << e.what() << "\n";
+	}
+}
+
+
+bool MySqlStorage::findAgentId(MySqlJdbcConnector &db, const std::string &agent, int &id)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_ids_mutex);
+
+		auto find = m_agent_ids.find(agent);
+		if (find != m_agent_ids.end())
+		{
+			id = find->second;
+			return true;
+		}
+	}
+
+	sql::PreparedStatement *stat = db.cachedStatement("SELECT id FROM agents WHERE name = ?");
+	stat->setString(1, agent);
+
+	std::unique_ptr<sql::ResultSet> res(stat->executeQuery());
+	if (!res->first())
+	{
+		return false;
+	}
+
+	id = res->getInt("id");
+
+	std::lock_guard<std::mutex> lock(m_ids_mutex);
+	m_agent_ids[agent] = id;
+	return true;
+}
+
+
+MySqlStorage::Session::Session(MySqlStorage &storage) :
+	m_storage{ storage }
+{
+	;
+}
+
+
+bool MySqlStorage::Session::begin()
+{
+	m_connection = std::make_unique<MySqlConnectionPool::Connection>(m_storage.m_pool.acquire());
+	m_db = &**m_connection;
+
+	return m_connection->isConnected();
+}
+
+
+void MySqlStorage::Session::end()
+{
+	m_db = nullptr;
+	m_connection.reset();
+}
+
+
+StorageBackend::WriteResult MySqlStorage::Session::write(const std::vector<const StorageEvent *> &events, uint64_t &written)
+{
+	for (unsigned int attempt = 1; ; attempt++)
+	{
+		written = 0;
+		m_inserted_agents.clear();
+		m_oldest_history = 0;
+
+		try
+		{
+			m_db->beginTransaction();
+
+			// Statuses are written together after the other changes, agents inserted
+			// by this transaction have their rows by then. Only the newest status of an
+			// agent is written, the earlier ones count as written with it.
+			std::map<std::string, const StorageEvent *> latest_statuses;
+			uint64_t superseded = 0;
+			for (const StorageEvent *event : events)
+			{
+				if (event->type == StorageEvent::AGENT_STATUS)
+				{
+					const StorageEvent *&latest = latest_statuses[event->agent];
+					if (latest)
+					{
+						superseded++;
+					}
+
+					latest = event;
+
+					// History is written in order, only the agents row is deferred
+					writeEvent(*event);
+				}
+				else
+				{
+					// A reconnect writes the status, the ones seen before it are outdated
+					if (event->type == StorageEvent::AGENT_CONNECTED && latest_statuses.erase(event->agent))
+					{
+						superseded++;
+					}
+
+					if (writeEvent(*event))
+					{
+						written++;
+					}
+				}
+			}
+
+			std::vector<const StorageEvent *> statuses;
+			for (const auto &el : latest_statuses)
+			{
+				statuses.push_back(el.second);
+			}
+
+			written += superseded + updateAgentStatuses(statuses);
+
+			m_db->commit();
+
+			if (m_oldest_history)
+			{
+				m_storage.historyWritten(m_oldest_history);
+			}
+
+			return WRITE_COMMITTED;
+		}
+		catch (sql::SQLException &e)
+		{
+			rollback(events);
+
+			if (isConnectionError(e))
+			{
+				std::cerr << "[MySqlStorage] Lost connection while writing: " << e.what() << "\n";
+				return WRITE_DISCONNECTED;
+			}
+
+			// Deadlock or lock wait timeout, the whole transaction was rolled back and can be repeated
+			bool retry = e.getErrorCode() == ERROR_LOCK_DEADLOCK || e.getErrorCode() == ERROR_LOCK_WAIT_TIMEOUT;
+			if (!retry || attempt >= MAX_TRANSACTION_ATTEMPTS)
+			{
+				std::cerr << "[MySqlStorage] Failed to write " << events.size() << " change(s): " << e.what() << "\n";
+				return WRITE_FAILED;
+			}
+
+			std::cerr << "[MySqlStorage] Transaction failed (" << e.what() << "), retrying\n";
+		}
+	}
+}
+
+
+void MySqlStorage::Session::rollback(const std::vector<const StorageEvent *> &events)
+{
+	try
+	{
+		m_db->rollback();
+	}
+	catch (sql::SQLException &e)
+	{
+		std::cerr << "[MySqlStorage] Rollback failed: " << e.what() << "\n";
+	}
+
+	// The rolled back history was never there for the rollup
+	m_oldest_history = 0;
+
+	// What was remembered about the rolled back rows isn't true anymore
+	std::lock_guard<std::mutex> lock(m_storage.m_ids_mutex);
+
+	for (const StorageEvent *event : events)
+	{
+		auto find = m_storage.m_agent_ids.find(event->agent);
+		if (find != m_storage.m_agent_ids.end())
+		{
+			m_processes.erase(find->second);
+			m_closed_out.erase(find->second);
+		}
+	}
+
+	for (const std::string &agent : m_inserted_agents)
+	{
+		m_storage.m_agent_ids.erase(agent);
+	}
+}
+
+
+bool MySqlStorage::Session::writeEvent(const StorageEvent &event)
+{
+	try
+	{
+		switch (event.type)
+		{
+		case StorageEvent::AGENT_CONNECTED:
+			addAgent(event.agent, event.ip, event.status);
+			return true;
+
+		case StorageEvent::AGENT_STATUS:
+			// The status itself is written by updateAgentStatuses
+			if (event.status != StorageEvent::STATUS_RUNNING)
+			{
+				closeOutProcesses(event.agent, event.observed_at);
+			}
+
+			return true;
+
+		case StorageEvent::AGENT_PROCESSES:
+			return updateAgentProcesses(event.agent, event.processes, event.observed_at);
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		// These roll back the whole transaction
+		if (abortsTransaction(e))
+		{
+			throw;
+		}
+
+		// Only the failed statement is rolled back, the rest of the transaction goes on
+		std::cerr << "[MySqlStorage] SQL error while writing agent \"" << event.agent << "\": " << e.what() << "\n";
+	}
+
+	return false;
+}
+
+
+void MySqlStorage::Session::addAgent(const std::string &agent, const std::string &ip, int status)
+{
+	int agent_id;
+	if (!m_storage.findAgentId(*m_db, agent, agent_id))
+	{
+		sql::PreparedStatement *insert = m_db->cachedStatement("INSERT INTO agents (name, ip, status) VALUES (?, ?, ?)");
+		insert->setString(1, agent);
+		insert->setString(2, ip);
+		insert->setInt(3, status);
+		insert->execute();
+
+		// Caches the id of the new row
+		m_storage.findAgentId(*m_db, agent, agent_id);
+		m_inserted_agents.push_back(agent);
+	}
+	else
+	{
+		// The agent may have been restarted with a different configuration, sync its processes in full
+		m_processes.erase(agent_id);
+
+		sql::PreparedStatement *update = m_db->cachedStatement("UPDATE agents SET last_updated = now(), ip = ?, status = ? WHERE id = ?");
+		update->setString(1, ip);
+		update->setInt(2, status);
+		update->setInt(3, agent_id);
+		update->execute();
+	}
+}
+
+
+uint64_t MySqlStorage::Session::updateAgentStatuses(const std::vector<const StorageEvent *> &events)
+{
+	// agents.id, status
+	std::vector<std::pair<int, int>> rows;
+	for (const StorageEvent *event : events)
+	{
+		int agent_id;
+		if (m_storage.findAgentId(*m_db, event->agent, agent_id))
+		{
+			rows.push_back(std::make_pair(agent_id, event->status));
+		}
+		else
+		{
+			std::cerr << "[MySqlStorage] Failed to update agent \"" << event->agent << "\" status\n";
+		}
+	}
+
+	uint64_t written = 0;
+	for (size_t start = 0; start < rows.size(); start += BATCH_SIZE)
+	{
+		size_t count = std::min(rows.size() - start, BATCH_SIZE);
+		size_t padded = statementRows(count);
+
+		try
+		{
+			sql::PreparedStatement *update = m_db->cachedStatement("UPDATE agents SET last_updated = now(), status = CASE id "
+				+ placeholders("WHEN ? THEN ?", padded, " ") + " END WHERE id IN (" + placeholders("?", padded) + ")");
+
+			unsigned int param = 1;
+			for (size_t i = 0; i < padded; i++)
+			{
+				const auto &row = rows[start + std::min(i, count - 1)];
+				update->setInt(param++, row.first);
+				update->setInt(param++, row.second);
+			}
+
+			for (size_t i = 0; i < padded; i++)
+			{
+				update->setInt(param++, rows[start + std::min(i, count - 1)].first);
+			}
+
+			update->execute();
+			written += count;
+		}
+		catch (sql::SQLException &e)
+		{
+			if (abortsTransaction(e))
+			{
+				throw;
+			}
+
+			std::cerr << "[MySqlStorage] SQL error while updating status of " << count << " agent(s): " << e.what() << "\n";
+		}
+	}
+
+	return written;
+}
+
+
+bool MySqlStorage::Session::updateAgentProcesses(const std::string &agent, const json &processes, std::time_t observed_at)
+{
+	int agent_id;
+	if (!m_storage.findAgentId(*m_db, agent, agent_id))
+	{
+		return false;
+	}
+
+	// Taken out of m_processes until the writes succeed, a failed write means reading the rows again next time
+	ProcessStates last;
+	auto find = m_processes.find(agent_id);
+	bool synced = find != m_processes.end();
+	if (synced)
+	{
+		last = std::move(find->second);
+		m_processes.erase(find);
+	}
+	else
+	{
+		// Nothing is known about the rows, start from what is stored
+		sql::PreparedStatement *select = m_db->cachedStatement("SELECT name, status FROM processes WHERE agent_id = ? AND monitored = 1");
+		select->setInt(1, agent_id);
+
+		std::unique_ptr<sql::ResultSet> res(select->executeQuery());
+		while (res->next())
+		{
+			last[res->getString("name")] = res->getInt("status");
+		}
+	}
+
+	ProcessStates current;
+	for (const auto &el : processes.items())
+	{
+		current[el.key()] = el.value();
+	}
+
+	// Only write what changed since the last write: removed, added, started and stopped processes
+	std::vector<std::string> removed;
+	for (const auto &el : last)
+	{
+		if (!current.count(el.first))
+		{
+			removed.push_back(el.first);
+		}
+	}
+
+	ProcessStates changed;
+	for (const auto &el : current)
+	{
+		auto known = last.find(el.first);
+		if (known == last.end() || known->second != el.second)
+		{
+			changed.insert(el);
+		}
+	}
+
+	for (size_t start = 0; start < removed.size(); start += BATCH_SIZE)
+	{
+		size_t count = std::min(removed.size() - start, BATCH_SIZE);
+		size_t padded = statementRows(count);
+
+		sql::PreparedStatement *unmonitor = m_db->cachedStatement("UPDATE processes SET monitored = 0 WHERE agent_id = ? AND name IN ("
+			+ placeholders("?", padded) + ")");
+		unmonitor->setInt(1, agent_id);
+
+		unsigned int param = 2;
+		for (size_t i = 0; i < padded; i++)
+		{
+			unmonitor->setString(param++, removed[start + std::min(i, count - 1)]);
+		}
+
+		unmonitor->execute();
+	}
+
+	upsertProcesses(agent_id, changed);
+
+	// After a restart, a reconnect or an outage of the agent the history may not have the current
+	// state of the processes, all of them get a transition. Repeated states don't count in rollups.
+	std::vector<std::string> transitions = removed;
+	for (const auto &el : synced ? changed : current)
+	{
+		transitions.push_back(el.first);
+	}
+
+	appendHistory(agent_id, transitions, observed_at);
+
+	m_processes[agent_id] = std::move(current);
+	m_closed_out.erase(agent_id);
+	return true;
+}
+
+
+void MySqlStorage::Session::closeOutProcesses(const std::string &agent, std::time_t at)
+{
+	int agent_id;
+	if (!m_storage.findAgentId(*m_db, agent, agent_id) || m_closed_out.count(agent_id))
+	{
+		return;
+	}
+
+	sql::PreparedStatement *insert = m_db->cachedStatement("INSERT INTO process_history (process_id, changed_at, state) "
+		"SELECT id, ?, " + std::to_string(ProcessHistory::STATE_UNMONITORED) + " FROM processes "
+		"WHERE agent_id = ? AND monitored = 1 ON DUPLICATE KEY UPDATE state = VALUES(state)");
+	insert->setInt64(1, at);
+	insert->setInt(2, agent_id);
+	insert->execute();
+
+	historyAppended(at);
+
+	// The next process list writes the history of all processes again
+	m_processes.erase(agent_id);
+	m_closed_out.insert(agent_id);
+}
+
+
+void MySqlStorage::Session::upsertProcesses(int agent_id, const ProcessStates &processes)
+{
+	// BATCH_SIZE rows per statement, relies on the unique key on processes (agent_id, name)
+	std::vector<std::pair<std::string, int>> rows(processes.begin(), processes.end());
+	for (size_t start = 0; start < rows.size(); start += BATCH_SIZE)
+	{
+		size_t count = std::min(rows.size() - start, BATCH_SIZE);
+		size_t padded = statementRows(count);
+
+		sql::PreparedStatement *upsert = m_db->cachedStatement("INSERT INTO processes (agent_id, name, monitored, status) VALUES "
+			+ placeholders("(?, ?, 1, ?)", padded) + " ON DUPLICATE KEY UPDATE monitored = 1, status = VALUES(status)");
+
+		unsigned int param = 1;
+		for (size_t i = 0; i < padded; i++)
+		{
+			const auto &row = rows[start + std::min(i, count - 1)];
+			upsert->setInt(param++, agent_id);
+			upsert->setString(param++, row.first);
+			upsert->setInt(param++, row.second);
+		}
+
+		upsert->execute();
+	}
+}
+
+
+void MySqlStorage::Session::appendHistory(int agent_id, const std::vector<std::string> &names, std::time_t at)
+{
+	if (names.empty())
+	{
+		return;
+	}
+
+	// Ids and new states are taken from the rows that were just written
+	for (size_t start = 0; start < names.size(); start += BATCH_SIZE)
+	{
+		size_t count = std::min(names.size() - start, BATCH_SIZE);
+		size_t padded = statementRows(count);
+
+		sql::PreparedStatement *insert = m_db->cachedStatement("INSERT INTO process_history (process_id, changed_at, state) "
+			"SELECT id, ?, IF(monitored = 1, status, " + std::to_string(ProcessHistory::STATE_UNMONITORED) + ") FROM processes "
+			"WHERE agent_id = ? AND name IN (" + placeholders("?", padded) + ") ON DUPLICATE KEY UPDATE state = VALUES(state)");
+		insert->setInt64(1, at);
+		insert->setInt(2, agent_id);
+
+		unsigned int param = 3;
+		for (size_t i = 0; i < padded; i++)
+		{
+			insert->setString(param++, names[start + std::min(i, count - 1)]);
+		}
+
+		insert->execute();
+	}
+
+	historyAppended(at);
+}
+
+
+void MySqlStorage::Session::historyAppended(std::time_t at)
+{
+	if (!m_oldest_history || at < m_oldest_history)
+	{
+		m_oldest_history = at;
+	}
+}
+
+
+void MySqlStorage::historyWritten(std::time_t at)
+{
+	std::lock_guard<std::mutex> lock(m_history_mutex);
+
+	if (!m_oldest_history || at < m_oldest_history)
+	{
+		m_oldest_history = at;
+	}
+}
+
+
+void MySqlStorage::rollup(std::time_t now)
+{
+	std::time_t end = ProcessHistory::hourStart(now - ProcessHistory::ROLLUP_DELAY);
+
+	std::time_t oldest_history;
+	{
+		std::lock_guard<std::mutex> lock(m_history_mutex);
+		oldest_history = m_oldest_history;
+		m_oldest_history = 0;
+	}
+
+	// Transitions written late (from the spool or a queue that fell behind) roll their hours up again
+	if (oldest_history && oldest_history < m_rolled_up_to)
+	{
+		m_rolled_up_to = 0;
+	}
+
+	if (m_rolled_up_to >= end)
+	{
+		return;
+	}
+
+	MySqlConnectionPool::Connection db = m_pool.acquire();
+	if (!db.isConnected())
+	{
+		if (oldest_history)
+		{
+			historyWritten(oldest_history);
+		}
+
+		return;
+	}
+
+	try
+	{
+		if (!m_rolled_up_to && !startRollup(*db, oldest_history))
+		{
+			return;
+		}
+
+		while (m_rolled_up_to < end)
+		{
+			rollupHour(*db, m_rolled_up_to);
+			m_rolled_up_to += ProcessHistory::HOUR;
+		}
+	}
+	catch (sql::SQLException &e)
+	{
+		std::cerr << "[MySqlStorage] Failed to roll up process history: " << e.what() << "\n";
+
+		try
+		{
+			db->rollback();
+		}
+		catch (sql::SQLException &)
+		{
+			;
+		}
+
+		// Starts over from what was committed
+		m_rolled_up_to = 0;
+		if (oldest_history)
+		{
+			historyWritten(oldest_history);
+		}
+	}
+}
+
+
+bool MySqlStorage::startRollup(MySqlJdbcConnector &db, std::time_t oldest_history)
+{
+	auto stat = db.createStatement();
+
+	// Continues after the last rolled up hour, or from the first transition
+	std::time_t start = 0;
+	std::unique_ptr<sql::ResultSet> res(stat->executeQuery("SELECT MAX(period_start) AS last FROM process_uptime WHERE period = 'hour'"));
+	if (res->first() && !res->isNull("last"))
+	{
+		start = static_cast<std::time_t>(res->getInt64("last")) + ProcessHistory::HOUR;
+	}
+	else
+	{
+		res.reset(stat->executeQuery("SELECT MIN(changed_at) AS first FROM process_history"));
+		if (!res->first() || res->isNull("first"))
+		{
+			return false;
+		}
+
+		start = ProcessHistory::hourStart(static_cast<std::time_t>(res->getInt64("first")));
+	}
+
+	if (oldest_history)
+	{
+		start = std::min(start, ProcessHistory::hourStart(oldest_history));
+	}
+
+	// State of every process when the hour starts is its last transition before it
+	sql::PreparedStatement *states = db.cachedStatement("SELECT h.process_id, h.state FROM process_history h "
+		"JOIN (SELECT process_id, MAX(changed_at) AS changed_at FROM process_history WHERE changed_at < ? GROUP BY process_id) last "
+		"ON h.process_id = last.process_id AND h.changed_at = last.changed_at");
+	states->setInt64(1, start);
+
+	m_rollup_states.clear();
+	res.reset(states->executeQuery());
+	while (res->next())
+	{
+		int state = res->getInt("state");
+		if (state != ProcessHistory::STATE_UNMONITORED)
+		{
+			m_rollup_states[res->getInt("process_id")] = state;
+		}
+	}
+
+	m_rolled_up_to = start;
+	return true;
+}
+
+
+void MySqlStorage::rollupHour(MySqlJdbcConnector &db, std::time_t start)
+{
+	std::time_t end = start + ProcessHistory::HOUR;
+
+	std::map<int, std::vector<ProcessHistory::Transition>> transitions;
+
+	sql::PreparedStatement *select = db.cachedStatement("SELECT process_id, changed_at, state FROM process_history "
+		"WHERE changed_at >= ? AND changed_at < ? ORDER BY process_id, changed_at");
+	select->setInt64(1, start);
+	select->setInt64(2, end);
+
+	std::unique_ptr<sql::ResultSet> res(select->executeQuery());
+	while (res->next())
+	{
+		transitions[res->getInt("process_id")].push_back({ static_cast<std::time_t>(res->getInt64("changed_at")), res->getInt("state") });
+	}
+
+	for (const auto &el : transitions)
+	{
+		m_rollup_states.insert(std::make_pair(el.first, ProcessHistory::STATE_UNMONITORED));
+	}
+
+	// processes.id, uptime in the hour
+	std::vector<std::pair<int, ProcessHistory::Uptime>> rows;
+	static const std::vector<ProcessHistory::Transition> none;
+	for (auto it = m_rollup_states.begin(); it != m_rollup_states.end(); )
+	{
+		auto find = transitions.find(it->first);
+		ProcessHistory::Uptime uptime = ProcessHistory::summarize(it->second, find != transitions.end() ? find->second : none, start, end);
+		if (uptime.monitored || uptime.transitions)
+		{
+			rows.push_back(std::make_pair(it->first, uptime));
+		}
+
+		if (it->second == ProcessHistory::STATE_UNMONITORED)
+		{
+			it = m_rollup_states.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	db.beginTransaction();
+
+	for (size_t first = 0; first < rows.size(); first += BATCH_SIZE)
+	{
+		size_t count = std::min(rows.size() - first, BATCH_SIZE);
+		size_t padded = statementRows(count);
+
+		sql::PreparedStatement *upsert = db.cachedStatement("INSERT INTO process_uptime (process_id, period, period_start, running_seconds, monitored_seconds, transitions) VALUES "
+			+ placeholders("(?, 'hour', ?, ?, ?, ?)", padded) + " ON DUPLICATE KEY UPDATE running_seconds = VALUES(running_seconds), "
+			"monitored_seconds = VALUES(monitored_seconds), transitions = VALUES(transitions)");
+
+		unsigned int param = 1;
+		for (size_t i = 0; i < padded; i++)
+		{
+			const auto &row = rows[first + std::min(i, count - 1)];
+			upsert->setInt(param++, row.first);
+			upsert->setInt64(param++, start);
+			upsert->setUInt(param++, row.second.running);
+			upsert->setUInt(param++, row.second.monitored);
+			upsert->setUInt(param++, row.second.transitions);
+		}
+
+		upsert->execute();
+	}
+
+	// Last hour of a day, the day is the sum of its hours
+	if (end % ProcessHistory::DAY == 0)
+	{
+		std::time_t day_start = end - ProcessHistory::DAY;
+
+		sql::PreparedStatement *day = db.cachedStatement("INSERT INTO process_uptime (process_id, period, period_start, running_seconds, monitored_seconds, transitions) "
+			"SELECT process_id, 'day', ?, SUM(running_seconds), SUM(monitored_seconds), SUM(transitions) FROM process_uptime "
+			"WHERE period = 'hour' AND period_start >= ? AND period_start < ? GROUP BY process_id "
+			"ON DUPLICATE KEY UPDATE running_seconds = VALUES(running_seconds), monitored_seconds = VALUES(monitored_seconds), transitions = VALUES(transitions)");
+		day->setInt64(1, day_start);
+		day->setInt64(2, day_start);
+		day->setInt64(3, end);
+		day->execute();
+	}
+
+	db.commit();
+}
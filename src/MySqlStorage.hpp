@@ -0,0 +1,134 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "MySqlConnectionPool.hpp"
+#include "ProcessHistory.hpp"
+#include "StorageBackend.hpp"
+
+
+// Agent states in the agents and processes tables of a Mysql database, the schema is
+// created and updated by MySqlSchema on connect
+//
+// Process state changes are appended to process_history and rolled up per hour and per day
+// into process_uptime.
+class MySqlStorage : public StorageBackend
+{
+public:
+	// Rows written by a single multi-row statement. Statuses of a whole transaction
+	// (DbWriter::TRANSACTION_SIZE) fit into one.
+	static const size_t BATCH_SIZE{ 500 };
+	// Transactions that fail on a deadlock or lock wait timeout are repeated up to this many times
+	static const unsigned int MAX_TRANSACTION_ATTEMPTS{ 3 };
+
+	// MySQL error codes
+	static const int ERROR_LOCK_WAIT_TIMEOUT{ 1205 };
+	static const int ERROR_LOCK_DEADLOCK{ 1213 };
+	static const int ERROR_CONNECTION{ 2002 };
+	static const int ERROR_CONN_HOST{ 2003 };
+	static const int ERROR_SERVER_GONE{ 2006 };
+	static const int ERROR_SERVER_LOST{ 2013 };
+	static const int ERROR_SERVER_LOST_EXTENDED{ 2055 };
+
+private:
+	// Process name -> status
+	using ProcessStates = std::map<std::string, int>;
+
+	// Writes one event batch at a time in a transaction on a pooled connection
+	class Session : public StorageBackend::Session
+	{
+	private:
+		MySqlStorage &m_storage;
+
+		// Connection checked out between begin() and end()
+		std::unique_ptr<MySqlConnectionPool::Connection> m_connection;
+		MySqlJdbcConnector *m_db{ nullptr };
+
+		// Last process states written for every agent id, only the differences are written.
+		// Agents are always written by the same session.
+		std::map<int, ProcessStates> m_processes;
+		// Agents inserted by the current transaction
+		std::vector<std::string> m_inserted_agents;
+		// Agents whose processes are in the history as unmonitored since the agent went down
+		std::set<int> m_closed_out;
+		// Time of the oldest transition written by the current transaction, 0 = none. The rollup
+		// is told about it only after the commit, before that it can't see the rows.
+		std::time_t m_oldest_history{ 0 };
+
+		void rollback(const std::vector<const StorageEvent *> &events);
+		// SQL errors other than deadlocks are logged and make it return false
+		bool writeEvent(const StorageEvent &event);
+
+		// If agent with that name doesn't exist, create a new record
+		// If it does exist, update its ip, status and last_updated
+		void addAgent(const std::string &agent, const std::string &ip, int status);
+		// Writes all statuses with one statement per BATCH_SIZE agents, returns how many were written
+		uint64_t updateAgentStatuses(const std::vector<const StorageEvent *> &events);
+		bool updateAgentProcesses(const std::string &agent, const json &processes, std::time_t observed_at);
+		// Inserts the processes or updates their status
+		void upsertProcesses(int agent_id, const ProcessStates &processes);
+		// Adds a transition to the current state of the processes, after their rows were written
+		void appendHistory(int agent_id, const std::vector<std::string> &names, std::time_t at);
+		// Agent stopped answering, its monitored processes are unmonitored in the history from then on
+		void closeOutProcesses(const std::string &agent, std::time_t at);
+		void historyAppended(std::time_t at);
+
+	public:
+		Session(MySqlStorage &storage);
+
+		bool begin() override;
+		void end() override;
+		WriteResult write(const std::vector<const StorageEvent *> &events, uint64_t &written) override;
+	};
+
+	MySqlConnectionPool m_pool;
+
+	// agents.id by agent name, ids never change once the row exists
+	std::mutex m_ids_mutex;
+	std::map<std::string, int> m_agent_ids;
+
+	// Time of the oldest transition written since the last rollup, 0 = none
+	std::mutex m_history_mutex;
+	std::time_t m_oldest_history{ 0 };
+
+	// Only touched by rollup()
+
+	// Start of the first hour that isn't rolled up yet, 0 = has to be read from the database
+	std::time_t m_rolled_up_to{ 0 };
+	// State of every monitored process at m_rolled_up_to, by processes.id
+	std::map<int, int> m_rollup_states;
+
+	void historyWritten(std::time_t at);
+	// Returns false if there is no history to roll up
+	bool startRollup(MySqlJdbcConnector &db, std::time_t oldest_history);
+	void rollupHour(MySqlJdbcConnector &db, std::time_t start);
+
+	// Fills m_agent_ids with every known agent, so the first cycle doesn't look them up one by one
+	void loadAgentIds();
+	// Returns false if the agent isn't in the agents table
+	bool findAgentId(MySqlJdbcConnector &db, const std::string &agent, int &id);
+
+	static bool isConnectionError(const sql::SQLException &e);
+	// Errors after which the server rolls back the whole transaction
+	static bool abortsTransaction(const sql::SQLException &e);
+
+	// "group, group, ..." with count groups, for multi-row statements
+	static std::string placeholders(const std::string &group, size_t count, const std::string &separator = ", ");
+	// Rows of the statement for count rows (at most BATCH_SIZE): one of a few sizes, so every
+	// connection prepares only a handful of statements. Rows past count repeat the last one.
+	static size_t statementRows(size_t count);
+
+public:
+	bool connect(const Configuration &config) override;
+
+	// One session per pooled connection
+	size_t getConcurrency() const override { return m_pool.size(); }
+	std::unique_ptr<StorageBackend::Session> createSession() override;
+	// Must not be called from more threads at once
+	void rollup(std::time_t now) override;
+};
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+#include "PollScheduler.hpp"
+
+
+const unsigned int PollScheduler::TICK_MS;
+const unsigned int PollScheduler::WHEEL_BITS;
+const size_t PollScheduler::WHEEL_SIZE;
+const size_t PollScheduler::LEVELS;
+const unsigned int PollScheduler::BACKOFF_PERCENT;
+
+
+PollScheduler::PollScheduler() :
+	m_start{ std::chrono::steady_clock::now() }
+{
+	;
+}
+
+
+uint64_t PollScheduler::currentTick() const
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_start).count() / TICK_MS;
+}
+
+
+uint64_t PollScheduler::toTicks(std::chrono::milliseconds interval) const
+{
+	// Half of the wheel's range, so a due time is always within it
+	const uint64_t max_ticks = (uint64_t(1) << (WHEEL_BITS * LEVELS)) / 2;
+
+	uint64_t ticks = static_cast<uint64_t>(std::max<int64_t>(interval.count(), 0)) / TICK_MS;
+	return std::min(std::max<uint64_t>(ticks, 1), max_ticks);
+}
+
+
+void PollScheduler::setLimits(std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_min_interval = toTicks(min_interval);
+	m_max_interval = std::max(toTicks(max_interval), m_min_interval);
+}
+
+
+void PollScheduler::schedule(const std::string &agent, std::chrono::milliseconds interval, bool adaptive)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto find = m_agents.find(agent);
+		if (find != m_agents.end())
+		{
+			find->second.interval = toTicks(interval);
+			find->second.adaptive = adaptive;
+			return;
+		}
+
+		Agent &entry = m_agents[agent];
+		entry.interval = toTicks(interval);
+		entry.adaptive = adaptive;
+
+		// The offset depends only on the name, an agent that reconnects keeps its place
+		uint64_t offset = std::hash<std::string>()(agent) % entry.interval;
+		addTimer(agent, entry, std::max(m_tick, currentTick()) + 1 + offset);
+	}
+
+	m_wakeup.notify_one();
+}
+
+
+void PollScheduler::remove(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Its timer is skipped when it fires
+	m_agents.erase(agent);
+}
+
+
+void PollScheduler::finished(const std::string &agent, size_t state)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end() || !find->second.polling)
+	{
+		return;
+	}
+
+	Agent &entry = find->second;
+	entry.polling = false;
+
+	bool changed = entry.has_state && entry.state != state;
+	entry.has_state = true;
+	entry.state = state;
+
+	if (entry.adaptive && m_max_interval)
+	{
+		if (changed)
+		{
+			entry.interval = m_min_interval;
+		}
+		else
+		{
+			uint64_t longer = entry.interval + std::max<uint64_t>(entry.interval * BACKOFF_PERCENT / 100, 1);
+			entry.interval = std::min(std::max(longer, m_min_interval), m_max_interval);
+		}
+	}
+
+	reschedule(agent, entry);
+	m_wakeup.notify_one();
+}
+
+
+void PollScheduler::skipped(const std::string &agent)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto find = m_agents.find(agent);
+	if (find == m_agents.end() || !find->second.polling)
+	{
+		return;
+	}
+
+	find->second.polling = false;
+	reschedule(agent, find->second);
+	m_wakeup.notify_one();
+}
+
+
+void PollScheduler::reschedule(const std::string &agent, Agent &entry)
+{
+	uint64_t due_tick = entry.due_tick + entry.interval;
+	uint64_t now = std::max(m_tick, currentTick());
+	if (due_tick <= now)
+	{
+		due_tick += ((now - due_tick) / entry.interval + 1) * entry.interval;
+	}
+
+	addTimer(agent, entry, due_tick);
+}
+
+
+void PollScheduler::addTimer(const std::string &agent, Agent &entry, uint64_t due_tick)
+{
+	entry.due_tick = due_tick;
+	entry.timer_id = m_next_timer_id++;
+
+	Timer timer;
+	timer.agent = agent;
+	timer.due_tick = due_tick;
+	timer.id = entry.timer_id;
+	insert(std::move(timer));
+}
+
+
+void PollScheduler::insert(Timer timer)
+{
+	if (timer.due_tick <= m_tick)
+	{
+		m_expired.push_back(std::move(timer));
+		return;
+	}
+
+	// The lowest level whose range reaches the due time, the slot is given by the due time's
+	// digit at that level
+	uint64_t delta = timer.due_tick - m_tick;
+	for (size_t level = 0; level < LEVELS; level++)
+	{
+		if (level == LEVELS - 1 || delta < (uint64_t(1) << (WHEEL_BITS * (level + 1))))
+		{
+			size_t slot = (timer.due_tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1);
+			m_wheels[level][slot].push_back(std::move(timer));
+			return;
+		}
+	}
+}
+
+
+void PollScheduler::advance(std::vector<Timer> &due)
+{
+	m_tick++;
+
+	// Lower wheel wrapped around, timers of the next slot of the higher levels move down,
+	// starting at the highest one so their timers can go down more than one level
+	size_t top = 0;
+	while (top + 1 < LEVELS && (m_tick & ((uint64_t(1) << (WHEEL_BITS * (top + 1))) - 1)) == 0)
+	{
+		top++;
+	}
+
+	for (size_t level = top; level > 0; level--)
+	{
+		std::vector<Timer> &slot = m_wheels[level][(m_tick >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+		std::vector<Timer> timers;
+		timers.swap(slot);
+
+		for (auto &timer : timers)
+		{
+			insert(std::move(timer));
+		}
+	}
+
+	std::vector<Timer> &slot = m_wheels[0][m_tick & (WHEEL_SIZE - 1)];
+	std::move(slot.begin(), slot.end(), std::back_inserter(due));
+	slot.clear();
+
+	// Moved down right at their due time
+	std::move(m_expired.begin(), m_expired.end(), std::back_inserter(due));
+	m_expired.clear();
+}
+
+
+std::vector<std::string> PollScheduler::waitDue()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	while (true)
+	{
+		std::vector<Timer> timers;
+		timers.swap(m_expired);
+
+		uint64_t now = currentTick();
+		while (m_tick < now)
+		{
+			advance(timers);
+		}
+
+		std::vector<std::string> due;
+		for (const auto &timer : timers)
+		{
+			auto find = m_agents.find(timer.agent);
+			if (find != m_agents.end() && find->second.timer_id == timer.id && !find->second.polling)
+			{
+				find->second.polling = true;
+				due.push_back(timer.agent);
+			}
+		}
+
+		if (!due.empty())
+		{
+			return due;
+		}
+
+		m_wakeup.wait_until(lock, m_start + std::chrono::milliseconds((m_tick + 1) * TICK_MS));
+	}
+}
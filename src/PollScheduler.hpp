@@ -0,0 +1,109 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+// Tells when each agent is due for its next poll
+//
+// Every agent has its own interval and due time, kept in a hierarchical timer wheel on
+// steady_clock: level 0 has one slot per tick, each higher level has slots WHEEL_SIZE times
+// longer, whose timers move down a level when the lower wheel wraps around. Adding and firing
+// a timer doesn't depend on the number of agents.
+//
+// The first poll of an agent is delayed by an offset within its interval derived from its name,
+// so agents are spread evenly over the interval instead of all being polled at once. The next
+// due time counts from the previous one, not from the end of the poll, so it doesn't drift.
+//
+// Intervals of adaptive agents follow how often their state changes: a change drops the interval
+// to the minimum, every poll that finds the same state makes it BACKOFF_PERCENT longer, up to
+// the maximum. Steady agents end up polled rarely, agents that flap often.
+class PollScheduler
+{
+public:
+	// Resolution of the due times
+	static const unsigned int TICK_MS{ 100 };
+	static const unsigned int WHEEL_BITS{ 6 };
+	static const size_t WHEEL_SIZE{ 1 << WHEEL_BITS };
+	static const size_t LEVELS{ 4 };
+	// Interval growth after a poll that found no change
+	static const unsigned int BACKOFF_PERCENT{ 50 };
+
+private:
+	struct Timer
+	{
+		std::string agent;
+		uint64_t due_tick;
+		// Timers of removed or rescheduled agents stay in the wheel and are skipped when they fire
+		uint64_t id;
+	};
+
+	struct Agent
+	{
+		uint64_t interval;
+		uint64_t due_tick;
+		uint64_t timer_id;
+		// Returned by waitDue and not finished yet, it isn't in the wheel
+		bool polling{ false };
+
+		bool adaptive{ true };
+		// Fingerprint of the state found by the last poll
+		bool has_state{ false };
+		size_t state{ 0 };
+	};
+
+	std::mutex m_mutex;
+	// Notified when a timer is added, waitDue otherwise sleeps until the next tick
+	std::condition_variable m_wakeup;
+
+	std::chrono::steady_clock::time_point m_start;
+	// Last tick processed by waitDue
+	uint64_t m_tick{ 0 };
+	std::array<std::array<std::vector<Timer>, WHEEL_SIZE>, LEVELS> m_wheels;
+	// Timers that were due by the time they were added
+	std::vector<Timer> m_expired;
+
+	std::map<std::string, Agent> m_agents;
+	uint64_t m_next_timer_id{ 1 };
+
+	// Limits of adaptive intervals, in ticks, 0 = intervals don't adapt
+	uint64_t m_min_interval{ 0 };
+	uint64_t m_max_interval{ 0 };
+
+	// These expect m_mutex to be locked
+	uint64_t currentTick() const;
+	uint64_t toTicks(std::chrono::milliseconds interval) const;
+	void addTimer(const std::string &agent, Agent &entry, uint64_t due_tick);
+	// Adds the timer of the poll one interval after the last one
+	void reschedule(const std::string &agent, Agent &entry);
+	void insert(Timer timer);
+	// Moves to the next tick, timers that fire in it are added to due
+	void advance(std::vector<Timer> &due);
+
+public:
+	PollScheduler();
+
+	void setLimits(std::chrono::milliseconds min_interval, std::chrono::milliseconds max_interval);
+
+	// Adds the agent, or changes the interval of an agent that is scheduled already.
+	// A new interval is used from the next poll of the agent. Intervals of agents that
+	// aren't adaptive stay as they are.
+	void schedule(const std::string &agent, std::chrono::milliseconds interval, bool adaptive = true);
+	void remove(const std::string &agent);
+
+	// Blocks until at least one agent is due and returns the due agents. They aren't
+	// due again until their poll is finished.
+	std::vector<std::string> waitDue();
+	// Schedules the next poll of the agent, one interval after the last due time. Polls that
+	// are late because the last one took too long are skipped, the agent keeps its offset.
+	// state is a fingerprint of what the poll found, it's compared to the one of the last poll.
+	void finished(const std::string &agent, size_t state);
+	// Schedules the next poll of an agent that was due but wasn't polled, its interval stays the same
+	void skipped(const std::string &agent);
+};
@@ -0,0 +1,68 @@
+#include "ProcessHistory.hpp"
+
+
+const int ProcessHistory::STATE_UNMONITORED;
+const std::time_t ProcessHistory::HOUR;
+const std::time_t ProcessHistory::DAY;
+const std::time_t ProcessHistory::ROLLUP_DELAY;
+
+
+void ProcessHistory::Uptime::add(const Uptime &other)
+{
+	running += other.running;
+	monitored += other.monitored;
+	transitions += other.transitions;
+}
+
+
+ProcessHistory::Uptime ProcessHistory::summarize(int &state, const std::vector<Transition> &transitions, std::time_t start, std::time_t end)
+{
+	Uptime uptime;
+
+	std::time_t since = start;
+	for (const Transition &transition : transitions)
+	{
+		if (transition.at < start)
+		{
+			continue;
+		}
+
+		if (transition.at >= end)
+		{
+			break;
+		}
+
+		if (transition.state == state)
+		{
+			continue;
+		}
+
+		uint32_t seconds = static_cast<uint32_t>(transition.at - since);
+		if (state != STATE_UNMONITORED)
+		{
+			uptime.monitored += seconds;
+		}
+
+		if (isRunning(state))
+		{
+			uptime.running += seconds;
+		}
+
+		uptime.transitions++;
+		state = transition.state;
+		since = transition.at;
+	}
+
+	uint32_t seconds = static_cast<uint32_t>(end - since);
+	if (state != STATE_UNMONITORED)
+	{
+		uptime.monitored += seconds;
+	}
+
+	if (isRunning(state))
+	{
+		uptime.running += seconds;
+	}
+
+	return uptime;
+}
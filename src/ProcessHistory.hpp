@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <ctime>
+#include <vector>
+
+
+// State transitions of monitored processes and the uptime rolled up from them
+//
+// Only changes are stored: a process that keeps running adds no history, its state at
+// any time is the state of its last transition before it.
+class ProcessHistory
+{
+public:
+	// Stored state of a process: its status (0 = not running, 1 = running) or STATE_UNMONITORED
+	static const int STATE_UNMONITORED{ -1 };
+
+	static const std::time_t HOUR{ 3600 };
+	static const std::time_t DAY{ 24 * HOUR };
+	// An hour is rolled up this long after it ends, so the last changes queued in it are written first
+	static const std::time_t ROLLUP_DELAY{ 120 };
+
+	struct Transition
+	{
+		std::time_t at;
+		int state;
+	};
+
+	// Seconds of one period, per process
+	struct Uptime
+	{
+		uint32_t running{ 0 };
+		uint32_t monitored{ 0 };
+		uint32_t transitions{ 0 };
+
+		void add(const Uptime &other);
+	};
+
+	// Uptime of the period [start, end) of a process that was in state at start. transitions
+	// have to be sorted by time, the ones outside of the period are skipped. state is updated
+	// to the state at end.
+	static Uptime summarize(int &state, const std::vector<Transition> &transitions, std::time_t start, std::time_t end);
+
+	static bool isRunning(int state) { return state > 0; }
+	static std::time_t hourStart(std::time_t t) { return t - t % HOUR; }
+	static std::time_t dayStart(std::time_t t) { return t - t % DAY; }
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "json.hpp"
+#include "Configuration.hpp"
+
+
+using json = nlohmann::json;
+
+
+// Change of an agent's state to be stored
+struct StorageEvent
+{
+	// Agent status of an agent that answers, the same as AgentManager::AGENT_RUNNING
+	static const int STATUS_RUNNING{ 1 };
+
+	enum Type
+	{
+		AGENT_CONNECTED,
+		AGENT_STATUS,
+		AGENT_PROCESSES
+	};
+
+	Type type;
+	std::string agent;
+	// AGENT_CONNECTED
+	std::string ip;
+	// AGENT_CONNECTED, AGENT_STATUS. Any other status than STATUS_RUNNING means nothing is
+	// known about the agent's processes until its next process list.
+	int status{ 0 };
+	// AGENT_PROCESSES, process name -> running
+	json processes;
+
+	// When the change was seen, process transitions are stored with this time
+	std::time_t observed_at{ 0 };
+	std::chrono::steady_clock::time_point queued_at;
+};
+
+
+// Where agent states are kept, selected with <Storage> in the configuration
+class StorageBackend
+{
+public:
+	enum WriteResult
+	{
+		WRITE_COMMITTED,
+		// Nothing was written
+		WRITE_FAILED,
+		// Nothing was written, the storage can't be reached
+		WRITE_DISCONNECTED
+	};
+
+	// Writes of a single writer thread, a session is never used by two threads at once
+	class Session
+	{
+	public:
+		virtual ~Session() {}
+
+		// Called before every batch of writes, returns false if the storage can't be reached.
+		// end() is called after the batch either way.
+		virtual bool begin() = 0;
+		virtual void end() = 0;
+
+		// Writes the events as a single unit: agent upserts, status updates and process syncs.
+		// written is the number of events that succeeded when the result is WRITE_COMMITTED.
+		virtual WriteResult write(const std::vector<const StorageEvent *> &events, uint64_t &written) = 0;
+	};
+
+	virtual ~StorageBackend() {}
+
+	virtual bool connect(const Configuration &config) = 0;
+
+	// Number of sessions that can write at the same time
+	virtual size_t getConcurrency() const = 0;
+	virtual std::unique_ptr<Session> createSession() = 0;
+
+	// Rolls the process history of every hour that ended before now up into uptime per hour
+	// and per day. Called periodically, periods that are rolled up already are skipped.
+	virtual void rollup(std::time_t now) = 0;
+};